@@ -0,0 +1,59 @@
+/**
+ * parallel_each() with and without line aligned chunks, from 1 to 32
+ * threads. The grain is small and odd on purpose: unaligned, neighbour
+ * chunks share the cache line at their border, and the threads writing
+ * them keep stealing it from each other.
+ *
+ *     make bench
+ */
+#include <cstdio>
+#include <chrono>
+
+#include "ecs.hpp"
+
+struct Position {
+	float x, y;
+};
+
+struct Velocity {
+	float x, y;
+};
+
+static const size_t ENTITIES = 1 << 20;
+static const size_t GRAIN = 13;
+static const int ROUNDS = 20;
+
+// milliseconds per parallel_each() over every entity
+static double run(ecs::System<Position, Velocity>& s, bool align_lines) {
+	auto step = [](u64, Position& p, Velocity& v) {
+		p.x += v.x;
+		p.y += v.y;
+	};
+
+	// warm up the pool and the caches
+	s.parallel_each<Position, Velocity>(step, GRAIN, align_lines);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < ROUNDS; r++)
+		s.parallel_each<Position, Velocity>(step, GRAIN, align_lines);
+	std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+
+	return took.count() / ROUNDS;
+}
+
+int main() {
+	ecs::System<Position, Velocity> s;
+	s.instantiate(s.make_prefab(Position {0, 0}, Velocity {1, 1}), ENTITIES);
+
+	std::printf("%zu entities, grain %zu\n", ENTITIES, GRAIN);
+	std::printf("%8s %12s %12s\n", "threads", "unaligned", "aligned");
+
+	for (size_t threads = 1; threads <= 32; threads *= 2) {
+		s.set_workers(threads - 1);
+		double unaligned = run(s, false);
+		double aligned = run(s, true);
+		std::printf("%8zu %10.2fms %10.2fms\n", threads, unaligned, aligned);
+	}
+
+	return 0;
+}
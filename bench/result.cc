@@ -0,0 +1,70 @@
+/**
+ * Returning a Result<int, int> against returning the plain {value, tag}
+ * struct it is meant to compile down to. Both callees are kept out of
+ * line, so the times only match if the Result comes back in registers
+ * like the struct does, rather than through memory.
+ *
+ *     make bench
+ */
+#include <cstdio>
+#include <chrono>
+
+#include "utils/result.hpp"
+
+// keep the compiler from inlining, cloning or seeing through the callees
+#if defined(__clang__)
+#define OUT_OF_LINE __attribute__((noinline))
+#else
+#define OUT_OF_LINE __attribute__((noipa))
+#endif
+
+struct Plain {
+	int value;
+	bool ok;
+};
+
+static const int CALLS = 100000000;
+
+OUT_OF_LINE static Result<int, int> checked(int x) {
+	if ((x & 1023) == 0)
+		return types::Err<int>(x);
+	return types::Ok<int>(x * 3);
+}
+
+OUT_OF_LINE static Plain plain(int x) {
+	if ((x & 1023) == 0)
+		return {x, false};
+	return {x * 3, true};
+}
+
+// nanoseconds per call of fn, which folds the input into the sum
+template<typename F>
+static double run(F&& fn, long& sum) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < CALLS; i++)
+		sum += fn(i);
+	std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+
+	return took.count() / CALLS;
+}
+
+int main() {
+	static_assert(sizeof(Result<int, int>) == sizeof(Plain), "Result<int, int> must be an int and a tag");
+
+	long sum = 0;
+	double ns_plain = run([](int i) {
+		Plain p = plain(i);
+		return p.ok ? p.value : -p.value;
+	}, sum);
+	double ns_result = run([](int i) {
+		Result<int, int> r = checked(i);
+		return r.isOk() ? r.unwrap() : -r.unwrapErr();
+	}, sum);
+
+	std::printf("%d calls\n", CALLS);
+	std::printf("%8s %10.3fns\n", "plain", ns_plain);
+	std::printf("%8s %10.3fns\n", "Result", ns_result);
+
+	// keeps the loops alive
+	return sum == 42;
+}
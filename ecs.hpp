@@ -1,17 +1,108 @@
 #pragma once
 
+#include <new>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <stack>
+#include <array>
+#include <cmath>
+#include <vector>
+#include <tuple>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utils/result.hpp"
 #include "utils/types.hpp"
 #include "utils/metaprog.hpp"
 #include "utils/numeric.hpp"
 #include "utils/bits.hpp"
+#include "utils/jobs.hpp"
+#include "utils/hashmap.hpp"
+#include "utils/radix.hpp"
+#include "utils/spsc.hpp"
+#include "utils/coro.hpp"
+#include "utils/segmented.hpp"
+
+// C++20 builds get coroutine systems, see System::spawn_task()
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#define ECS_COROUTINES
+#include <mutex>
+#include <type_traits>
+#endif
 
 namespace ecs {
 
 #define INTERNAL_FLAG_ALIVE 0
 
+	/**
+	 * The try_* accessors of System validate their handles and return an
+	 * EcsError instead of touching the wrong entity. Building with
+	 * ECS_UNCHECKED defined compiles the validation out, they then always
+	 * succeed and cost the same as the raw accessors.
+	 */
+#ifdef ECS_UNCHECKED
+	static constexpr bool CHECKED_ACCESS = false;
+#else
+	static constexpr bool CHECKED_ACCESS = true;
+#endif
+
+	enum class EcsError {
+		// the handle never referred to an entity, or the entity is dead
+		// and its handle index not in use again
+		DeadEntity,
+		// the entity was killed and its handle index reused since
+		StaleGeneration,
+		ComponentNotEnabled,
+		// the handle belongs to another shard, see Shards
+		WrongShard,
+		// a file could not be opened, mapped or written
+		IoError,
+		// a column file is truncated, or its columns don't match the
+		// components of the System
+		BadFormat,
+	};
+
+	/**
+	 * Column files, read by System::load_columns() and written by
+	 * System::save_columns(), hold the components of a batch of entities
+	 * column by column:
+	 *
+	 *   ColumnFileHeader
+	 *   then, columns times: ColumnHeader, count * size bytes of raw
+	 *   component data, zero padded to a multiple of 8 bytes.
+	 *
+	 * Only trivially copyable components can be stored in them, and the
+	 * data is in the byte order and layout of the machine.
+	 */
+	struct ColumnFileHeader {
+		static constexpr u32 MAGIC = 0x43534345; // "ECSC"
+		static constexpr u32 VERSION = 1;
+
+		u32 magic;
+		u32 version;
+		u64 count;
+		u32 columns;
+		u32 reserved;
+	};
+
+	struct ColumnHeader {
+		// index of the component in the System component list
+		u32 component;
+		// sizeof the component
+		u32 size;
+	};
+
 	struct Entity {
 		// flags = 0 means the entity is dead and the space allocated for it
 		// will be reused.
@@ -33,48 +124,469 @@ namespace ecs {
 		void setmask(u64 mask) {
 			utils::bits::setbit(mask, this->masks);
 		}
+
+		void clearmask(u64 mask) {
+			utils::bits::clearbit(mask, this->masks);
+		}
 	};
 	static_assert(std::is_trivial<Entity>(), "ecs::Entity must be a trivial type");
 
 	struct EntityStore {
 
 		/**
-		 * The way of using @handle_type will probably change in the future,
-		 * because, I don't know why, but I see something bad about it right now.
-		 * Tbh, it works, for now.
+		 * A handle is a generational index: the low 32 bits index
+		 * this->slots and the high 24 bits hold the generation of that index
+		 * at spawn time, so handles to killed entities can be told apart
+		 * from the entity that reuses the index. The 8 bits in between are
+		 * the shard of the store, so handles stay unique across the
+		 * Systems of a Shards.
 		 */
 		using handle_type = u64;
-		std::vector<Entity> entities;
 
-		// index to non used entries in this->entities
+		// not a handle to any entity
+		static constexpr handle_type NONE = ~handle_type(0);
+
+		// slots[i] is not attached to any entry of this->entities
+		static constexpr u32 NO_SLOT = ~u32(0);
+
+		// storage for the entities, addressed by slot. Slots move around
+		// when the store is compacted, handles don't. Segmented like the
+		// component columns, so spawning never copies the store.
+		utils::segmented::Vector<Entity> entities;
+
+		// owners[slot] is the handle of the entity stored in that slot
+		utils::segmented::Vector<handle_type> owners;
+
+		// indirection table: handle index -> slot in this->entities
+		std::vector<u32> slots;
+		std::vector<u32> generations;
+
+		// handle indexes of killed entities, ready to be reused
 		std::stack<handle_type> entity_pool;
 
+		// generations wrap around at 24 bits
+		static constexpr u32 GENERATION_MASK = (u32(1) << 24) - 1;
+
+		// stamped on every handle this store hands out
+		u8 shard = 0;
+
+		handle_type make_handle(u32 index, u32 generation) const {
+			return (u64(generation) << 40) | (u64(shard) << 32) | index;
+		}
+
+		static u32 index_of(handle_type h) {
+			return u32(h);
+		}
+
+		static u32 generation_of(handle_type h) {
+			return u32(h >> 40);
+		}
+
+		static u8 shard_of(handle_type h) {
+			return u8(h >> 32);
+		}
+
+		u32 slot(handle_type h) const {
+			return slots[index_of(h)];
+		}
+
+		bool alive(handle_type h) {
+			u32 i = index_of(h);
+
+			if (i >= slots.size() || slots[i] == NO_SLOT ||
+					generations[i] != generation_of(h) || shard_of(h) != shard)
+				return false;
+
+			return entities[slots[i]].isflag(INTERNAL_FLAG_ALIVE);
+		}
+
 		handle_type spawn() {
+			u32 index;
 
 			if (entity_pool.size() > 0) {
-				handle_type h = entity_pool.top();
-				entities[h].flags |= INTERNAL_FLAG_ALIVE;
+				index = entity_pool.top();
 				entity_pool.pop();
-				return h;
+			} else {
+				index = slots.size();
+				slots.push_back(NO_SLOT);
+				generations.push_back(0);
+			}
+
+			handle_type handle = make_handle(index, generations[index]);
+
+			// the slot of a killed entity is kept until the store is
+			// compacted, in which case a new one is appended.
+			if (slots[index] == NO_SLOT) {
+				slots[index] = entities.size();
+				entities.push_back({0, 0});
+				owners.push_back(handle);
 			}
 
-			handle_type handle = entities.size();
-			Entity e {0, 0};
+			Entity& e = entities[slots[index]];
+			e = {0, 0};
 			e.setflag(INTERNAL_FLAG_ALIVE);
-			entities.push_back(e);
+			owners[slots[index]] = handle;
 
 			return handle;
 		}
 
+		/**
+		 * Spawn @n entities with the given component @mask on fresh handle
+		 * indexes and slots, without going through the pool: the handles
+		 * are the contiguous range starting at the returned one.
+		 */
+		handle_type spawn_bulk(size_t n, u64 mask) {
+			u32 index = slots.size();
+			u32 slot = entities.size();
+
+			Entity e {0, mask};
+			e.setflag(INTERNAL_FLAG_ALIVE);
+
+			slots.resize(index + n);
+			generations.resize(index + n, 0);
+			entities.resize(slot + n, e);
+			owners.resize(slot + n);
+
+			for (size_t i = 0; i < n; i++) {
+				slots[index + i] = slot + i;
+				owners[slot + i] = make_handle(index + i, 0);
+			}
+
+			return make_handle(index, 0);
+		}
+
+		// Does nothing if @handle is already dead or stale.
 		void kill(handle_type handle) {
-			entities[handle].flags = 0;
-			entity_pool.push(handle);
+			if (!alive(handle))
+				return;
+
+			u32 i = index_of(handle);
+			entities[slots[i]].flags = 0;
+			generations[i] = (generations[i] + 1) & GENERATION_MASK;
+			entity_pool.push(i);
+		}
+
+		// Forget the slot of a dead entity, if its handle index still
+		// points to it. Used before the slot is reused or released.
+		void detach(u32 slot) {
+			u32 i = index_of(owners[slot]);
+			if (slots[i] == slot)
+				slots[i] = NO_SLOT;
+		}
+
+		// Move the (live) entity at @from into the (dead) slot @to.
+		void relocate(u32 from, u32 to) {
+			detach(to);
+			entities[to] = entities[from];
+			owners[to] = owners[from];
+			slots[index_of(owners[to])] = to;
+			entities[from].flags = 0;
+		}
+
+		// Exchange two live entities.
+		void swap(u32 a, u32 b) {
+			std::swap(entities[a], entities[b]);
+			std::swap(owners[a], owners[b]);
+			slots[index_of(owners[a])] = a;
+			slots[index_of(owners[b])] = b;
+		}
+
+		// Release every slot past @size. All of them must be dead.
+		void truncate(u32 size) {
+			for (u32 s = size; s < entities.size(); s++)
+				detach(s);
+
+			entities.resize(size);
+			owners.resize(size);
+			entities.shrink_to_fit();
+			owners.shrink_to_fit();
+		}
+	};
+
+	/**
+	 * Component policy for data read from the previous frame while the
+	 * current one is being written: use DoubleBuffered<T> as the component
+	 * and go through System::read<T>() / System::write<T>(). Which buffer
+	 * is which is decided by the frame parity of the ComponentStore, so
+	 * swapping them at the end of a frame is a single flip.
+	 *
+	 * The buffer written in a frame held the data of two frames ago, so
+	 * writers are expected to write every entity they own each frame.
+	 */
+	template<typename T>
+	struct DoubleBuffered {
+		T buffers[2];
+	};
+
+	/**
+	 * A component whose values are shared between entities: the entity
+	 * stores a 32 bit reference into the SharedPool<T> of the System, and
+	 * entities with equal values share one copy. Set through
+	 * System::share(), see there.
+	 */
+	template<typename T>
+	struct Shared {
+		static constexpr u32 NONE = ~u32(0);
+
+		u32 ref = NONE;
+	};
+
+	template<typename T>
+	struct is_shared : std::false_type { };
+
+	template<typename T>
+	struct is_shared<Shared<T>> : std::true_type { };
+
+	/**
+	 * Interned values of a Shared<T> component, hash consed: interning a
+	 * value equal to one already in the pool returns the existing entry.
+	 * Entries are reference counted and recycled once no entity uses them.
+	 * Trivially copyable values are hashed and compared byte-wise, others
+	 * through std::hash and operator==.
+	 */
+	template<typename T>
+	struct SharedPool {
+		static constexpr u32 NONE = Shared<T>::NONE;
+
+		// segmented, so references to the values stay valid
+		utils::segmented::Vector<T> values;
+		std::vector<u32> counts;
+		std::vector<u64> hashes;
+		// next entry with the same hash, or NONE
+		std::vector<u32> next;
+		// hash -> first entry with it
+		utils::hashmap::FlatMap<u64, u32> index;
+		std::vector<u32> free_entries;
+
+		size_t live = 0;
+
+		static u64 hash(const T& v) {
+			if constexpr (std::is_trivially_copyable<T>::value) {
+				// FNV-1a
+				auto bytes = reinterpret_cast<const unsigned char*>(&v);
+				u64 h = 0xcbf29ce484222325ULL;
+				for (size_t i = 0; i < sizeof(T); i++)
+					h = (h ^ bytes[i]) * 0x100000001b3ULL;
+				return h;
+			} else {
+				return std::hash<T> {}(v);
+			}
+		}
+
+		static bool equal(const T& a, const T& b) {
+			if constexpr (std::is_trivially_copyable<T>::value)
+				return std::memcmp(&a, &b, sizeof(T)) == 0;
+			else
+				return a == b;
+		}
+
+		const T& get(u32 ref) const {
+			return values[ref];
+		}
+
+		// The entry holding @v, created if needed, with one more user.
+		u32 intern(const T& v) {
+			u64 h = hash(v);
+			const u32* first = index.find(h);
+
+			for (u32 e = first ? *first : NONE; e != NONE; e = next[e]) {
+				if (equal(values[e], v)) {
+					counts[e]++;
+					return e;
+				}
+			}
+
+			u32 e;
+			if (!free_entries.empty()) {
+				e = free_entries.back();
+				free_entries.pop_back();
+				values[e] = v;
+			} else {
+				e = values.size();
+				values.push_back(v);
+				counts.push_back(0);
+				hashes.push_back(0);
+				next.push_back(NONE);
+			}
+
+			counts[e] = 1;
+			hashes[e] = h;
+			next[e] = first ? *first : NONE;
+			index.insert(h, e);
+			live++;
+			return e;
+		}
+
+		void acquire(u32 ref, u32 n = 1) {
+			counts[ref] += n;
+		}
+
+		// Drop a user of @ref, recycling the entry if it was the last.
+		void release(u32 ref) {
+			if (--counts[ref] > 0)
+				return;
+
+			u64 h = hashes[ref];
+			u32* first = index.find(h);
+			if (*first == ref) {
+				if (next[ref] == NONE)
+					index.erase(h);
+				else
+					*first = next[ref];
+			} else {
+				u32 e = *first;
+				while (next[e] != ref)
+					e = next[e];
+				next[e] = next[ref];
+			}
+
+			values[ref] = T {};
+			free_entries.push_back(ref);
+			live--;
+		}
+	};
+
+	// Storage the System keeps for its component C: a SharedPool for
+	// Shared<T> components, nothing for the others.
+	template<typename C>
+	struct shared_pool_of {
+		struct type { };
+	};
+
+	template<typename T>
+	struct shared_pool_of<Shared<T>> {
+		using type = SharedPool<T>;
+	};
+
+	/**
+	 * Layout and lifecycle of a component type only known at runtime
+	 * (scripts, plugins). move() move-constructs @dst, which holds no
+	 * object, from @src, which is left in a destructible state.
+	 */
+	struct ComponentInfo {
+		size_t size;
+		size_t align;
+		void (*construct)(void* p);
+		void (*destruct)(void* p);
+		void (*move)(void* dst, void* src);
+
+		template<typename T>
+		static ComponentInfo of() {
+			return {
+				sizeof(T), alignof(T),
+				[](void* p) { new (p) T(); },
+				[](void* p) { static_cast<T*>(p)->~T(); },
+				[](void* dst, void* src) { new (dst) T(std::move(*static_cast<T*>(src))); },
+			};
+		}
+	};
+
+	/**
+	 * Storage of a runtime component, one element per slot like the
+	 * columns of the ComponentStore, and segmented the same way: elements
+	 * live in blocks of about a page that are never reallocated. Every
+	 * element is constructed, whether its entity has the component
+	 * enabled or not.
+	 */
+	class ErasedColumn {
+	public:
+		explicit ErasedColumn(ComponentInfo info)
+			: info(info)
+			, stride((info.size + info.align - 1) / info.align * info.align)
+			, shift(utils::segmented::block_shift(stride))
+			, align(std::max(utils::segmented::BLOCK_ALIGN, info.align)) { }
+
+		ErasedColumn(ErasedColumn&& other)
+			: info(other.info), stride(other.stride), shift(other.shift), align(other.align)
+			, blocks(std::move(other.blocks)), count(other.count) {
+			other.blocks.clear();
+			other.count = 0;
+		}
+
+		ErasedColumn(const ErasedColumn&) = delete;
+		ErasedColumn& operator=(const ErasedColumn&) = delete;
+
+		~ErasedColumn() {
+			truncate(0);
+		}
+
+		void* at(size_t slot) {
+			size_t mask = (size_t(1) << shift) - 1;
+			return blocks[slot >> shift] + (slot & mask) * stride;
+		}
+
+		size_t size() const {
+			return count;
+		}
+
+		// bytes reserved for the column
+		size_t allocated() const {
+			return (blocks.size() << shift) * stride;
+		}
+
+		void grow(size_t n = 1) {
+			while ((blocks.size() << shift) < count + n)
+				blocks.push_back(static_cast<unsigned char*>(
+					::operator new(stride << shift, std::align_val_t(align))));
+
+			for (size_t i = 0; i < n; i++)
+				info.construct(at(count + i));
+			count += n;
+		}
+
+		void relocate(size_t from, size_t to) {
+			info.destruct(at(to));
+			info.move(at(to), at(from));
 		}
+
+		void swap(size_t a, size_t b) {
+			alignas(std::max_align_t) unsigned char small[64];
+			void* tmp = stride <= sizeof(small) && info.align <= alignof(std::max_align_t)
+				? small
+				: ::operator new(stride, std::align_val_t(info.align));
+
+			info.move(tmp, at(a));
+			info.destruct(at(a));
+			info.move(at(a), at(b));
+			info.destruct(at(b));
+			info.move(at(b), tmp);
+			info.destruct(tmp);
+
+			if (tmp != small)
+				::operator delete(tmp, std::align_val_t(info.align));
+		}
+
+		// Destroy every element past @size and release the blocks left
+		// empty.
+		void truncate(size_t size) {
+			for (size_t i = size; i < count; i++)
+				info.destruct(at(i));
+			count = size;
+
+			size_t used = (count + (size_t(1) << shift) - 1) >> shift;
+			for (size_t b = used; b < blocks.size(); b++)
+				::operator delete(blocks[b], std::align_val_t(align));
+			blocks.resize(used);
+		}
+
+		const ComponentInfo info;
+		const size_t stride;
+
+	private:
+		// log2 of the elements per block
+		const size_t shift;
+		const size_t align;
+
+		std::vector<unsigned char*> blocks;
+		size_t count = 0;
 	};
 
 	/**
-	 * A ComponentStore holds a container of ComponentSets, where a
-	 * ComponentSet is a set of all the Components an entity can have.
+	 * A ComponentStore holds one column per component, where each column
+	 * stores the component of every entity, addressed by slot. Columns are
+	 * segmented (see utils::segmented::Vector): components never move
+	 * when the store grows, so references to them stay valid until their
+	 * slot is relocated, swapped or truncated by a compaction.
 	 * Components are implemented as C++ types.
 	 */
 	template<
@@ -87,140 +599,2693 @@ namespace ecs {
 		// there can't be any more components than u64 can handle
 		static_assert(sizeof...(Rest) <= 64);
 
+		// a value for each component, used to fill slots in bulk
 		using ComponentSet = std::tuple<Rest...>;
 		static const size_t type_count = sizeof...(Rest);
 
-		std::vector<ComponentSet> comps;
+		template<typename C>
+		using Column = utils::segmented::Vector<C>;
 
-		// Get a reference to the Nth component of an entity
-		template<int N>
-		auto& get() {
-			return std::get<N>(this->comps);
-		}
-	};
+		std::tuple<Column<Rest>...> columns;
 
-	template<
-		typename ...Cs>
-	class System {
-	public:
-		using handle_type = EntityStore::handle_type;
+		// ticks[slot][N] is the tick at which the Nth component of the
+		// entity at @slot was last marked as changed.
+		utils::segmented::Vector<std::array<u64, type_count>> ticks;
 
-	public:
-		System() = default;
+		// fresh[slot] has the bits of the derived components of the entity
+		// at @slot computed since their inputs last changed.
+		utils::segmented::Vector<u64> fresh;
 
-	/// Public ECS related methods
-	public:
-		handle_type spawn_entity() {
-			auto h = this->es.spawn();
+		// columns of the components registered at runtime, their mask bits
+		// follow the ones of the static components.
+		std::vector<ErasedColumn> erased;
 
-			if (this->cs.comps.size() == h) {
-				this->cs.comps.push_back({});
-			}
+		// index of the DoubleBuffered buffers written during this frame,
+		// the other ones hold the previous frame.
+		u8 frame = 0;
 
-			return h;
+		template<typename C>
+		Column<C>& column() {
+			return std::get<Column<C>>(this->columns);
 		}
 
-		template<
-			typename First,
-			typename ...Rest>
-		void enable_components(handle_type handle) {
-			this->enable_component<First>(handle);
-			if constexpr (sizeof...(Rest) == 0)
-				return;
-			else
-				this->enable_components<Rest...>(handle);
+		// Get a reference to the C component stored at @slot
+		template<typename C>
+		C& get(size_t slot) {
+			return column<C>()[slot];
 		}
 
-		// return a vector of entity handles of all entities that have the Ts
-		// components enabled.
-		template<typename ...Ts>
-		const std::vector<handle_type> query() {
-			auto mask = this->get_components_mask<Ts...>();
-			std::vector<handle_type> query_result;
-
-			for (handle_type i = 0; i < this->es.entities.size(); i++) {
-				auto& e = this->es.entities[i];
-				if (e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(mask)) {
-					query_result.push_back(i);
-				}
-			}
+		template<typename T>
+		const T& previous(size_t slot) {
+			return get<DoubleBuffered<T>>(slot).buffers[frame ^ 1];
+		}
 
-			return query_result;
+		template<typename T>
+		T& current(size_t slot) {
+			return get<DoubleBuffered<T>>(slot).buffers[frame];
 		}
 
-		// TODO: implement me
-		void update() {
-			for (const auto& f : this->update_hooks) {
-				f();
-			}
+		void swap_buffers() {
+			frame ^= 1;
 		}
 
-	public:
-		void set_update_hooks(std::vector<std::function<void(void)>>&& hooks) {
-			this->update_hooks = std::move(hooks);
+		size_t size() const {
+			return ticks.size();
 		}
 
-		// Get a reference to the Nth component of an entity
+		// bytes reserved for the C components, including the slots not
+		// in use yet
 		template<typename C>
-		C& component(handle_type h) {
-			return std::get<C>(this->cs.comps[h]);
+		size_t allocated() const {
+			return std::get<Column<C>>(this->columns).capacity() * sizeof(C);
 		}
 
-	// Private ECS related methods: helpers / internal definitions.
-	private:
-		template<typename T>
-		void enable_component(handle_type handle) {
-			this->es.entities[handle].setmask(utils::metaprog::index<T, Cs...>());
+		// bytes of a slot, over all the columns
+		static constexpr size_t stride() {
+			return (0 + ... + sizeof(Rest));
 		}
 
-		template<
-			typename ...Ts>
-		u64 get_components_mask(){ 
-			u64 mask = 0;
-			this->_get_components_mask<Ts...>(mask);
-			return mask;
+		void grow() {
+			(column<Rest>().emplace_back(), ...);
+			ticks.emplace_back();
+			fresh.emplace_back(0);
+			for (auto& column : erased)
+				column.grow();
 		}
 
-		template<
-			typename First,
-			typename ...Rest>
-		void _get_components_mask(u64& history){ 
-			history |= (1 << utils::metaprog::index<First, Cs...>());
-			if constexpr (sizeof...(Rest) == 0)
-				return;
-			else
-				this->_get_components_mask<Rest...>(history);
+		// Append @n copies of @set, all stamped as changed at @tick.
+		void grow(size_t n, const ComponentSet& set, u64 tick) {
+			std::array<u64, type_count> stamp;
+			stamp.fill(tick);
+
+			size_t end = size() + n;
+			(column<Rest>().resize(end, std::get<Rest>(set)), ...);
+			ticks.resize(end, stamp);
+			fresh.resize(end, 0);
+			for (auto& column : erased)
+				column.grow(n);
 		}
 
-		/*
-		 * UNUSED
-		template<
-			typename First,
-			typename ...Ts>
-		std::vector<handle_type> component_indexes() {
-			std::vector<handle_type> is;
-			this->component_indexes_internal<First, Ts...>(is);
-			return is;
+		void relocate(size_t from, size_t to) {
+			((get<Rest>(to) = std::move(get<Rest>(from))), ...);
+			ticks[to] = ticks[from];
+			fresh[to] = fresh[from];
+			for (auto& column : erased)
+				column.relocate(from, to);
 		}
 
-		template<
-			typename First,
-			typename ...Ts>
-		void component_indexes_internal(std::vector<handle_type>& history) {
-			history.push_back(utils::metaprog::index<First, Cs...>());
-			if constexpr (sizeof...(Ts) == 0)
-				return;
-			else
-				this->component_indexes_internal<Ts...>(history);
+		void swap(size_t a, size_t b) {
+			using std::swap;
+			(swap(get<Rest>(a), get<Rest>(b)), ...);
+			swap(ticks[a], ticks[b]);
+			swap(fresh[a], fresh[b]);
+			for (auto& column : erased)
+				column.swap(a, b);
 		}
-		*/
 
-	private:
-		EntityStore es;
-		ComponentStore<Cs...> cs;
-		
-	private:
-		std::vector<std::function<void(void)>> update_hooks;
+		void truncate(size_t size) {
+			((column<Rest>().resize(size), column<Rest>().shrink_to_fit()), ...);
+			ticks.resize(size);
+			ticks.shrink_to_fit();
+			fresh.resize(size);
+			fresh.shrink_to_fit();
+			for (auto& column : erased)
+				column.truncate(size);
+		}
+	};
+
+	struct Vec3 {
+		float x, y, z;
+	};
+
+	/**
+	 * Tells the spatial index where an entity is, given its position
+	 * component. The default reads the x, y and (if there is one) z
+	 * members of the component; specialize it for anything else.
+	 */
+	template<typename P, typename = void>
+	struct spatial_traits {
+		static Vec3 position(const P& p) {
+			return {float(p.x), float(p.y), 0.0f};
+		}
+	};
+
+	template<typename P>
+	struct spatial_traits<P, std::void_t<decltype(std::declval<P>().z)>> {
+		static Vec3 position(const P& p) {
+			return {float(p.x), float(p.y), float(p.z)};
+		}
+	};
+
+	/**
+	 * Uniform hash grid of entity handles. Each entity is filed under the
+	 * cell its position falls in; only cells that hold something take
+	 * memory.
+	 */
+	struct SpatialGrid {
+		using handle_type = EntityStore::handle_type;
+
+		struct Entry {
+			u64 cell;
+			// position of the handle in cells[cell]
+			u32 pos;
+			bool filed = false;
+		};
+
+		float cell_size;
+		std::unordered_map<u64, std::vector<handle_type>> cells;
+
+		// indexed by handle index
+		std::vector<Entry> entries;
+
+		explicit SpatialGrid(float cell_size)
+			: cell_size(cell_size) { }
+
+		i32 coord(float v) const {
+			return i32(std::floor(v / cell_size));
+		}
+
+		static u64 key(i32 x, i32 y, i32 z) {
+			const u64 m = (1 << 21) - 1;
+			return ((u64(x) & m) << 42) | ((u64(y) & m) << 21) | (u64(z) & m);
+		}
+
+		u64 key(Vec3 p) const {
+			return key(coord(p.x), coord(p.y), coord(p.z));
+		}
+
+		void file(handle_type h, Vec3 p) {
+			u32 i = EntityStore::index_of(h);
+			if (i >= entries.size())
+				entries.resize(i + 1);
+
+			u64 k = key(p);
+			if (entries[i].filed) {
+				if (entries[i].cell == k)
+					return;
+				remove(h);
+			}
+
+			auto& cell = cells[k];
+			entries[i] = {k, u32(cell.size()), true};
+			cell.push_back(h);
+		}
+
+		void remove(handle_type h) {
+			u32 i = EntityStore::index_of(h);
+			if (i >= entries.size() || !entries[i].filed)
+				return;
+
+			auto it = cells.find(entries[i].cell);
+			auto& cell = it->second;
+			handle_type last = cell.back();
+
+			cell[entries[i].pos] = last;
+			entries[EntityStore::index_of(last)].pos = entries[i].pos;
+			cell.pop_back();
+
+			if (cell.empty())
+				cells.erase(it);
+
+			entries[i].filed = false;
+		}
+
+		// Call fn(handle) for every handle filed in a cell overlapping the
+		// box [@lo, @hi].
+		template<typename F>
+		void visit(Vec3 lo, Vec3 hi, F&& fn) const {
+			i32 x0 = coord(lo.x), y0 = coord(lo.y), z0 = coord(lo.z);
+			i32 x1 = coord(hi.x), y1 = coord(hi.y), z1 = coord(hi.z);
+
+			// a box covering more cells than there are filled ones is
+			// faster to handle by going through the filled ones.
+			double span = double(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+			if (span > cells.size()) {
+				for (const auto& [k, cell] : cells)
+					for (handle_type h : cell)
+						fn(h);
+				return;
+			}
+
+			for (i32 x = x0; x <= x1; x++)
+				for (i32 y = y0; y <= y1; y++)
+					for (i32 z = z0; z <= z1; z++) {
+						auto it = cells.find(key(x, y, z));
+						if (it == cells.end())
+							continue;
+						for (handle_type h : it->second)
+							fn(h);
+					}
+		}
+	};
+
+	/**
+	 * Parent/child relation between entities. The links are indexed by
+	 * handle index, and every node is also packed in the level of its
+	 * depth: walking the levels in order visits parents before their
+	 * children, and the nodes of one level never depend on each other.
+	 */
+	struct Hierarchy {
+		using handle_type = EntityStore::handle_type;
+		static constexpr handle_type NONE = EntityStore::NONE;
+
+		struct Node {
+			handle_type parent = NONE;
+			handle_type first_child = NONE;
+			handle_type next_sibling = NONE;
+			u32 depth = 0;
+			// position of the node in levels[depth]
+			u32 pos = 0;
+			bool linked = false;
+		};
+
+		std::vector<Node> nodes;
+		std::vector<std::vector<handle_type>> levels;
+
+		Node& node(handle_type h) {
+			u32 i = EntityStore::index_of(h);
+			if (i >= nodes.size())
+				nodes.resize(i + 1);
+			return nodes[i];
+		}
+
+		bool contains(handle_type h) const {
+			u32 i = EntityStore::index_of(h);
+			return i < nodes.size() && nodes[i].linked;
+		}
+
+		// Add @h as a root, if it is not already in the hierarchy.
+		void insert(handle_type h) {
+			Node& n = node(h);
+			if (n.linked)
+				return;
+
+			n = Node {};
+			n.linked = true;
+			place(h, 0);
+		}
+
+		// Returns false, leaving the hierarchy untouched, if @parent is
+		// @child itself or one of its descendants.
+		bool set_parent(handle_type child, handle_type parent) {
+			for (handle_type p = parent; p != NONE; p = node(p).parent)
+				if (p == child)
+					return false;
+
+			insert(child);
+			if (parent != NONE)
+				insert(parent);
+
+			unlink(child);
+
+			Node& c = node(child);
+			c.parent = parent;
+			if (parent != NONE) {
+				c.next_sibling = node(parent).first_child;
+				node(parent).first_child = child;
+			}
+
+			u32 depth = parent == NONE ? 0 : node(parent).depth + 1;
+			if (depth != c.depth)
+				move_subtree(child, depth);
+
+			return true;
+		}
+
+		// Take @h out of the hierarchy, its children become roots.
+		void remove(handle_type h) {
+			if (!contains(h))
+				return;
+
+			handle_type c = node(h).first_child;
+			while (c != NONE) {
+				handle_type next = node(c).next_sibling;
+				node(c).parent = NONE;
+				node(c).next_sibling = NONE;
+				move_subtree(c, 0);
+				c = next;
+			}
+
+			unlink(h);
+			displace(h);
+			node(h) = Node {};
+		}
+
+		/**
+		 * Rebuild the levels in breadth-first order, so the children of a
+		 * node are next to each other. set_parent() keeps the levels
+		 * depth-sorted but not packed.
+		 */
+		void repack() {
+			for (size_t d = 1; d < levels.size(); d++)
+				levels[d].clear();
+
+			for (size_t d = 0; d + 1 < levels.size(); d++) {
+				for (handle_type h : levels[d]) {
+					for (handle_type c = node(h).first_child; c != NONE; c = node(c).next_sibling) {
+						node(c).pos = levels[d + 1].size();
+						levels[d + 1].push_back(c);
+					}
+				}
+			}
+
+			while (!levels.empty() && levels.back().empty())
+				levels.pop_back();
+		}
+
+	private:
+		// Remove @child from the sibling list of its parent.
+		void unlink(handle_type child) {
+			handle_type parent = node(child).parent;
+			if (parent == NONE)
+				return;
+
+			handle_type* link = &node(parent).first_child;
+			while (*link != child)
+				link = &node(*link).next_sibling;
+			*link = node(child).next_sibling;
+
+			node(child).parent = NONE;
+			node(child).next_sibling = NONE;
+		}
+
+		void place(handle_type h, u32 depth) {
+			if (depth >= levels.size())
+				levels.resize(depth + 1);
+
+			node(h).depth = depth;
+			node(h).pos = levels[depth].size();
+			levels[depth].push_back(h);
+		}
+
+		void displace(handle_type h) {
+			auto& level = levels[node(h).depth];
+			handle_type last = level.back();
+
+			level[node(h).pos] = last;
+			node(last).pos = node(h).pos;
+			level.pop_back();
+		}
+
+		// Move @root and its descendants so that @root ends up at @depth.
+		void move_subtree(handle_type root, u32 depth) {
+			i64 delta = i64(depth) - i64(node(root).depth);
+
+			std::vector<handle_type> stack {root};
+			while (!stack.empty()) {
+				handle_type h = stack.back();
+				stack.pop_back();
+
+				displace(h);
+				place(h, node(h).depth + delta);
+
+				for (handle_type c = node(h).first_child; c != NONE; c = node(c).next_sibling)
+					stack.push_back(c);
+			}
+		}
+	};
+
+	/**
+	 * The (source, target) pairs of one kind of relation between entities,
+	 * many to many. Each entity has an adjacency list per direction, found
+	 * through a hash index, so both the targets of a source and the
+	 * sources of a target are lookups. Pairs are unordered within a list.
+	 */
+	struct Relations {
+		using handle_type = EntityStore::handle_type;
+
+		using Adjacency = utils::hashmap::FlatMap<handle_type, u32>;
+
+		// entity -> index of its list in this->lists, per direction
+		Adjacency out;
+		Adjacency in;
+
+		std::vector<std::vector<handle_type>> lists;
+		// indexes of emptied lists, ready to be reused
+		std::vector<u32> free_lists;
+
+		size_t pairs = 0;
+
+		const std::vector<handle_type>& targets(handle_type source) const {
+			return list(out, source);
+		}
+
+		const std::vector<handle_type>& sources(handle_type target) const {
+			return list(in, target);
+		}
+
+		bool contains(handle_type source, handle_type target) const {
+			auto& ts = targets(source);
+			auto& ss = sources(target);
+
+			// look in the shorter of the two lists
+			if (ts.size() <= ss.size())
+				return std::find(ts.begin(), ts.end(), target) != ts.end();
+			return std::find(ss.begin(), ss.end(), source) != ss.end();
+		}
+
+		// Returns false if the pair was already there.
+		bool add(handle_type source, handle_type target) {
+			if (contains(source, target))
+				return false;
+
+			lists[list_index(out, source)].push_back(target);
+			lists[list_index(in, target)].push_back(source);
+			pairs++;
+			return true;
+		}
+
+		// Returns false if there was no such pair.
+		bool remove(handle_type source, handle_type target) {
+			if (!contains(source, target))
+				return false;
+
+			erase(out, source, target);
+			erase(in, target, source);
+			pairs--;
+			return true;
+		}
+
+		// Remove every pair @h is part of, on either side.
+		void remove_entity(handle_type h) {
+			if (const u32* i = out.find(h)) {
+				for (handle_type target : lists[*i])
+					erase(in, target, h);
+				pairs -= lists[*i].size();
+				release(out, h, *i);
+			}
+
+			if (const u32* i = in.find(h)) {
+				for (handle_type source : lists[*i])
+					erase(out, source, h);
+				pairs -= lists[*i].size();
+				release(in, h, *i);
+			}
+		}
+
+	private:
+		const std::vector<handle_type>& list(const Adjacency& adjacency, handle_type h) const {
+			static const std::vector<handle_type> none;
+			const u32* i = adjacency.find(h);
+			return i ? lists[*i] : none;
+		}
+
+		u32 list_index(Adjacency& adjacency, handle_type h) {
+			if (const u32* i = adjacency.find(h))
+				return *i;
+
+			u32 i;
+			if (!free_lists.empty()) {
+				i = free_lists.back();
+				free_lists.pop_back();
+			} else {
+				i = lists.size();
+				lists.emplace_back();
+			}
+
+			adjacency.insert(h, i);
+			return i;
+		}
+
+		// Take @x out of the list of @h, releasing the list once empty.
+		void erase(Adjacency& adjacency, handle_type h, handle_type x) {
+			u32 i = *adjacency.find(h);
+			auto& l = lists[i];
+
+			auto it = std::find(l.begin(), l.end(), x);
+			*it = l.back();
+			l.pop_back();
+
+			if (l.empty())
+				release(adjacency, h, i);
+		}
+
+		void release(Adjacency& adjacency, handle_type h, u32 i) {
+			lists[i].clear();
+			free_lists.push_back(i);
+			adjacency.erase(h);
+		}
+	};
+
+	// What an observer registered with System::observe() is told about.
+	enum class Event {
+		// the component was enabled on the entities
+		Add,
+		// the component was disabled on the entities
+		Remove,
+		// the entities were killed while they had the component
+		Kill,
+	};
+
+	/**
+	 * A run of up to WIDTH consecutive slots handed to the kernel of
+	 * System::each_packet(): for each of the Ts components, a pointer to
+	 * its WIDTH contiguous values, and a lane mask telling which slots hold
+	 * a live entity with all the Ts. Kernels with a fixed trip count of
+	 * WIDTH over the pointers are easy for the compiler to vectorize.
+	 */
+	template<typename ...Ts>
+	struct Packet {
+		// slots never cross a block of any column
+		static constexpr size_t WIDTH = std::min({size_t(16),
+			utils::segmented::Vector<EntityStore::handle_type>::BLOCK,
+			utils::segmented::Vector<Ts>::BLOCK...});
+
+		// bit i is set if lane i is an entity with every Ts
+		u32 mask;
+		// lanes holding a slot at all, less than WIDTH at the end of the
+		// store
+		u32 size;
+		const EntityStore::handle_type* handles;
+		std::tuple<Ts*...> data;
+
+		template<typename C>
+		C* get() const {
+			return std::get<C*>(this->data);
+		}
+
+		bool active(size_t lane) const {
+			return (this->mask >> lane) & 1;
+		}
+
+		// every lane is an entity with the Ts, no need to check active()
+		bool full() const {
+			return this->mask == (u32(1) << WIDTH) - 1 && this->size == WIDTH;
+		}
+	};
+
+	/**
+	 * Memory and occupancy of a System, see System::stats(). Sizes are in
+	 * bytes.
+	 */
+	struct Stats {
+		struct Component {
+			// mask bit of the component, the id of runtime components
+			u32 id;
+			size_t size;
+			// reserved for the component, in every slot
+			size_t allocated;
+			// holding the component of a live entity that has it enabled
+			size_t used;
+			// live entities with the component enabled
+			size_t count;
+		};
+
+		size_t live = 0;
+		// killed entities still holding a slot, until compact()
+		size_t dead = 0;
+		// handle indexes in the entity pool, ready to be reused
+		size_t free_handles = 0;
+		size_t slots = 0;
+		// bytes per slot of the component store, over all its columns
+		size_t stride = 0;
+		// reserved by the entity store, handle tables and change ticks
+		size_t bookkeeping = 0;
+
+		// static components by index, then runtime components by id
+		std::vector<Component> components;
+
+		// (mask, live entities with exactly that mask), by increasing mask
+		std::vector<std::pair<u64, size_t>> masks;
+	};
+
+	// Dependencies of an update hook on a resource, see
+	// System::add_resource_hook().
+	template<typename T>
+	struct Read {
+		using type = T;
+		using reference = const T&;
+		static constexpr bool write = false;
+	};
+
+	template<typename T>
+	struct Write {
+		using type = T;
+		using reference = T&;
+		static constexpr bool write = true;
+	};
+
+	/**
+	 * When an update hook runs. By default a hook runs on every update().
+	 */
+	struct Schedule {
+		// run on every @every-th update()
+		u32 every = 1;
+		// run at most @hz times per second, 0 for no limit
+		float hz = 0;
+		// time a per-entity hook may spend in one update(), 0 for no limit
+		std::chrono::nanoseconds budget {0};
+	};
+
+	template<
+		typename ...Cs>
+	class System {
+	public:
+		using handle_type = EntityStore::handle_type;
+
+		// called with a batch of handles, see observe()
+		using observer_type = std::function<void(const handle_type*, size_t)>;
+
+	public:
+		System() = default;
+
+		// A System whose handles carry @shard, see Shards.
+		explicit System(u8 shard) {
+			this->es.shard = shard;
+		}
+
+		// Derivations, sorted views, hooks and tasks hold on to this, so a
+		// System stays where it was built. Keep it behind a pointer to move
+		// it around.
+		System(const System&) = delete;
+		System& operator=(const System&) = delete;
+		System(System&&) = delete;
+		System& operator=(System&&) = delete;
+
+	/// Public ECS related methods
+	public:
+		handle_type spawn_entity() {
+			auto h = this->es.spawn();
+
+			if (this->cs.size() == this->es.slot(h)) {
+				this->cs.grow();
+			}
+
+			return h;
+		}
+
+		// Spawn an entity and bind it to the external @id, see bind_id().
+		handle_type spawn_entity(u64 id) {
+			auto h = this->spawn_entity();
+			this->bind_id(h, id);
+			return h;
+		}
+
+		/**
+		 * A prefab is a set of component values and the matching mask,
+		 * registered once and then stamped out by instantiate().
+		 */
+		template<typename ...Ts>
+		u32 make_prefab(const Ts&... values) {
+			Prefab p {{}, this->get_components_mask<Ts...>()};
+			((std::get<Ts>(p.set) = values), ...);
+			// the prefab keeps the Shared values it refers to alive
+			(this->acquire_shared(values), ...);
+
+			this->prefabs.push_back(std::move(p));
+			return this->prefabs.size() - 1;
+		}
+
+		/**
+		 * Spawn @n entities as copies of @prefab. The component sets are
+		 * copied as whole blocks and the returned handle is the first of
+		 * a contiguous range: the ith entity is at handle + i.
+		 */
+		handle_type instantiate(u32 prefab, size_t n) {
+			const Prefab& p = this->prefabs[prefab];
+
+			handle_type first = this->es.spawn_bulk(n, p.mask);
+			this->cs.grow(n, p.set, this->tick);
+			this->follow_changes(p.mask, first, n);
+			((p.mask & this->get_components_mask<Cs>() ? this->acquire_shared(std::get<Cs>(p.set), n) : void()), ...);
+
+			this->record(Event::Add, p.mask, first, n);
+			return first;
+		}
+
+		/**
+		 * Write the C components of @n entities from the contiguous array
+		 * @src, enabling the component on them. Trivially copyable
+		 * components are copied bytewise.
+		 */
+		template<typename C>
+		void write_components(const handle_type* handles, size_t n, const C* src) {
+			for (size_t i = 0; i < n; i++) {
+				C& dst = this->component<C>(handles[i]);
+				this->acquire_shared(src[i]);
+				this->release_shared<C>(this->es.slot(handles[i]));
+				if constexpr (std::is_trivially_copyable<C>::value)
+					std::memcpy(&dst, &src[i], sizeof(C));
+				else
+					dst = src[i];
+				this->enable_component<C>(handles[i]);
+			}
+		}
+
+		/**
+		 * Spawn the entities stored in the column file at @path (see
+		 * ColumnFileHeader) and stream its columns straight into the
+		 * component storage. The file is memory mapped, not read. Returns
+		 * the first handle of the contiguous range of new entities, or
+		 * EntityStore::NONE if the file holds none.
+		 */
+		Result<handle_type, EcsError> load_columns(const char* path) {
+			int fd = open(path, O_RDONLY);
+			if (fd < 0)
+				return types::Err<EcsError>(EcsError::IoError);
+
+			struct stat st;
+			if (fstat(fd, &st) < 0) {
+				close(fd);
+				return types::Err<EcsError>(EcsError::IoError);
+			}
+			if (size_t(st.st_size) < sizeof(ColumnFileHeader)) {
+				close(fd);
+				return types::Err<EcsError>(EcsError::BadFormat);
+			}
+
+			void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (data == MAP_FAILED)
+				return types::Err<EcsError>(EcsError::IoError);
+
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			auto result = this->load_columns(data, st.st_size);
+			munmap(data, st.st_size);
+
+			return result;
+		}
+
+		// load_columns() from a column file already in memory.
+		Result<handle_type, EcsError> load_columns(const void* data, size_t size) {
+			auto bytes = static_cast<const unsigned char*>(data);
+
+			ColumnFileHeader header;
+			if (size < sizeof(header))
+				return types::Err<EcsError>(EcsError::BadFormat);
+			std::memcpy(&header, bytes, sizeof(header));
+
+			if (header.magic != ColumnFileHeader::MAGIC || header.version != ColumnFileHeader::VERSION)
+				return types::Err<EcsError>(EcsError::BadFormat);
+
+			// entities without any column can't be sized against the file,
+			// and the new ones must fit in the 32 bits of handle indexes
+			// and slots
+			size_t used = std::max(this->es.slots.size(), this->es.entities.size());
+			if ((header.columns == 0 && header.count != 0) || header.count >= EntityStore::NO_SLOT - used)
+				return types::Err<EcsError>(EcsError::BadFormat);
+
+			// check every column before touching the storage
+			u64 mask = 0;
+			size_t offset = sizeof(header);
+			for (u32 c = 0; c < header.columns; c++) {
+				ColumnHeader column;
+				if (offset > size || size - offset < sizeof(column))
+					return types::Err<EcsError>(EcsError::BadFormat);
+				std::memcpy(&column, bytes + offset, sizeof(column));
+				offset += sizeof(column);
+
+				bool loadable = this->visit_component(column.component, [&](auto* tag) {
+					using C = std::remove_pointer_t<decltype(tag)>;
+					// references to shared values mean nothing outside the
+					// System that interned them
+					return std::is_trivially_copyable<C>::value && !is_shared<C>::value &&
+						column.size == sizeof(C);
+				});
+
+				// a column can't hold more bytes than the file
+				u64 length = header.count * column.size;
+				if (!loadable || header.count > size / column.size || (size - offset) < length)
+					return types::Err<EcsError>(EcsError::BadFormat);
+
+				mask |= u64(1) << column.component;
+				offset += (length + 7) & ~u64(7);
+			}
+
+			if (header.count == 0)
+				return types::Ok<handle_type>(EntityStore::NONE);
+
+			handle_type first = this->es.spawn_bulk(header.count, mask);
+			this->cs.grow(header.count, {}, this->tick);
+			this->follow_changes(mask, first, header.count);
+			size_t slot = this->es.slot(first);
+
+			offset = sizeof(header);
+			for (u32 c = 0; c < header.columns; c++) {
+				ColumnHeader column;
+				std::memcpy(&column, bytes + offset, sizeof(column));
+				offset += sizeof(column);
+
+				const unsigned char* src = bytes + offset;
+				this->visit_component(column.component, [&](auto* tag) {
+					using C = std::remove_pointer_t<decltype(tag)>;
+					// one copy per block of the column
+					if constexpr (std::is_trivially_copyable<C>::value) {
+						auto& column = this->cs.template column<C>();
+						for (size_t i = 0, n; i < header.count; i += n) {
+							n = std::min<size_t>(column.contiguous(slot + i), header.count - i);
+							std::memcpy(&column[slot + i], src + i * sizeof(C), n * sizeof(C));
+						}
+					}
+					return true;
+				});
+
+				offset += (header.count * column.size + 7) & ~u64(7);
+			}
+
+			this->record(Event::Add, mask, first, header.count);
+			return types::Ok<handle_type>(first);
+		}
+
+		// Write the Ts components of @n entities to the column file @path.
+		template<typename ...Ts>
+		Result<void, EcsError> save_columns(const char* path, const handle_type* handles, size_t n) {
+			static_assert((std::is_trivially_copyable<Ts>::value && ...),
+					"only trivially copyable components can be saved");
+
+			FILE* f = std::fopen(path, "wb");
+			if (!f)
+				return types::Err<EcsError>(EcsError::IoError);
+
+			ColumnFileHeader header {ColumnFileHeader::MAGIC, ColumnFileHeader::VERSION, n, sizeof...(Ts), 0};
+			bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1;
+
+			auto save = [&](auto* tag) {
+				using C = std::remove_pointer_t<decltype(tag)>;
+				ColumnHeader column {u32(utils::metaprog::index<C, Cs...>()), sizeof(C)};
+				ok = ok && std::fwrite(&column, sizeof(column), 1, f) == 1;
+
+				for (size_t i = 0; i < n && ok; i++)
+					ok = std::fwrite(&this->component<C>(handles[i]), sizeof(C), 1, f) == 1;
+
+				const char zeros[8] = {};
+				size_t pad = ((n * sizeof(C) + 7) & ~size_t(7)) - n * sizeof(C);
+				ok = ok && std::fwrite(zeros, 1, pad, f) == pad;
+			};
+			(save(static_cast<Ts*>(nullptr)), ...);
+
+			ok = std::fclose(f) == 0 && ok;
+			if (!ok)
+				return types::Err<EcsError>(EcsError::IoError);
+			return types::Ok<void>();
+		}
+
+		// Does nothing if @handle is already dead or stale, its index may
+		// belong to another entity by now.
+		void kill_entity(handle_type handle) {
+			if (!this->es.alive(handle))
+				return;
+
+			this->unbind_id(handle);
+			this->hierarchy.remove(handle);
+			if (this->spatial)
+				this->spatial->remove(handle);
+			for (auto& r : this->relations)
+				if (r)
+					r->remove_entity(handle);
+			(this->release_shared<Cs>(this->es.slot(handle)), ...);
+
+			this->record(Event::Kill, this->es.entities[this->es.slot(handle)].masks, handle);
+			this->es.kill(handle);
+		}
+
+		bool alive(handle_type handle) {
+			return this->es.alive(handle);
+		}
+
+		/**
+		 * An entity on its way to another System: its component mask, the
+		 * values of all its components and its external id, if bound.
+		 * Runtime components registered with register_component(), Shared
+		 * components and relations don't travel.
+		 */
+		struct Migrant {
+			u64 mask = 0;
+			typename ComponentStore<Cs...>::ComponentSet set;
+			u64 id = 0;
+			bool has_id = false;
+		};
+
+		// Move @handle out of this System into a Migrant, killing it. The
+		// Migrant is empty if @handle is dead.
+		Migrant emigrate(handle_type handle) {
+			Migrant m;
+			if (!this->es.alive(handle))
+				return m;
+
+			u32 slot = this->es.slot(handle);
+			u32 i = EntityStore::index_of(handle);
+
+			m.mask = this->es.entities[slot].masks & this->get_components_mask<Cs...>();
+			((std::get<Cs>(m.set) = std::move(this->cs.template get<Cs>(slot))), ...);
+
+			// shared values live in the pools of this System
+			([&] {
+				if constexpr (is_shared<Cs>::value) {
+					std::get<Cs>(m.set).ref = Cs::NONE;
+					m.mask &= ~this->get_components_mask<Cs>();
+				}
+			}(), ...);
+
+			if (i < this->ids.size() && this->ids[i].second) {
+				m.id = this->ids[i].first;
+				m.has_id = true;
+			}
+
+			this->kill_entity(handle);
+			return m;
+		}
+
+		// Spawn the entity carried by @m. Its components are reported as
+		// added and changed, and its external id is bound again.
+		handle_type immigrate(Migrant&& m) {
+			handle_type h = this->spawn_entity();
+			u32 slot = this->es.slot(h);
+
+			((this->cs.template get<Cs>(slot) = std::move(std::get<Cs>(m.set))), ...);
+			((m.mask & this->get_components_mask<Cs>() ? this->enable_component<Cs>(h) : void()), ...);
+
+			if (m.has_id)
+				this->bind_id(h, m.id);
+
+			return h;
+		}
+
+		template<
+			typename First,
+			typename ...Rest>
+		void enable_components(handle_type handle) {
+			this->enable_component<First>(handle);
+			if constexpr (sizeof...(Rest) == 0)
+				return;
+			else
+				this->enable_components<Rest...>(handle);
+		}
+
+		template<typename ...Ts>
+		void disable_components(handle_type handle) {
+			(this->disable_component<Ts>(handle), ...);
+		}
+
+		/**
+		 * Register @fn to be told about the @event of the C component.
+		 * Events are not delivered as they happen but buffered, and
+		 * flush_events() hands every observer the whole batch of handles
+		 * at once. Handles of killed entities are already dead by then.
+		 * Components nobody observes don't buffer anything.
+		 */
+		template<typename C>
+		void observe(Event event, observer_type fn) {
+			u64 c = utils::metaprog::index<C, Cs...>();
+			this->observers[c][size_t(event)].push_back(std::move(fn));
+			utils::bits::setbit(c, this->observed[size_t(event)]);
+		}
+
+		// Deliver the buffered events. Called by update() once the hooks
+		// have run. Events raised by the observers are kept for the next
+		// flush.
+		void flush_events() {
+			for (size_t c = 0; c < sizeof...(Cs); c++) {
+				for (size_t e = 0; e < 3; e++) {
+					auto& buffer = this->events[c][e];
+					if (buffer.empty())
+						continue;
+
+					std::vector<handle_type> batch;
+					batch.swap(buffer);
+
+					for (const auto& fn : this->observers[c][e])
+						fn(batch.data(), batch.size());
+
+					if (buffer.empty()) {
+						batch.clear();
+						buffer.swap(batch);
+					}
+				}
+			}
+		}
+
+		/**
+		 * Register a component type at runtime. Returns its id, which is
+		 * also its bit in the component masks: runtime components take the
+		 * bits left over by the static ones. Their data lives in a
+		 * contiguous column, one element per slot, and they are not change
+		 * tracked nor observed. Tags (size 0) get a byte per slot, and an
+		 * align of 0 means 1; other aligns must be powers of two.
+		 */
+		u32 register_component(ComponentInfo info) {
+			u32 id = sizeof...(Cs) + this->cs.erased.size();
+			if (id >= 64) {
+				std::fprintf(stderr, "ecs: no component bit left for a runtime component\n");
+				std::terminate();
+			}
+
+			info.size = std::max<size_t>(info.size, 1);
+			info.align = std::max<size_t>(info.align, 1);
+			if ((info.align & (info.align - 1)) != 0) {
+				std::fprintf(stderr, "ecs: the align of a runtime component must be a power of two\n");
+				std::terminate();
+			}
+
+			ErasedColumn column(info);
+			column.grow(this->cs.size());
+			this->cs.erased.push_back(std::move(column));
+			return id;
+		}
+
+		void enable_component(handle_type handle, u32 id) {
+			this->es.entities[this->es.slot(handle)].setmask(id);
+		}
+
+		void disable_component(handle_type handle, u32 id) {
+			this->es.entities[this->es.slot(handle)].clearmask(id);
+		}
+
+		// the runtime component @id of @handle
+		void* component(handle_type handle, u32 id) {
+			return this->cs.erased[id - sizeof...(Cs)].at(this->es.slot(handle));
+		}
+
+		// return a vector of entity handles of all entities that have the Ts
+		// components enabled.
+		template<typename ...Ts>
+		const std::vector<handle_type> query() {
+			return this->query_mask(this->get_components_mask<Ts...>());
+		}
+
+		// query() on a raw component mask, which may include the bits of
+		// runtime components (u64(1) << id).
+		const std::vector<handle_type> query_mask(u64 mask) {
+			std::vector<handle_type> query_result;
+
+			for (size_t i = 0; i < this->es.entities.size(); i++) {
+				auto& e = this->es.entities[i];
+				if (e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(mask)) {
+					query_result.push_back(this->es.owners[i]);
+				}
+			}
+
+			return query_result;
+		}
+
+		/**
+		 * Call fn(Packet<Ts...>&) on the slots of the store, Packet::WIDTH
+		 * at a time, skipping the packets with no entity having all the
+		 * Ts. Lanes of the other entities (dead, or without one of the Ts)
+		 * point to storage too, so a kernel may compute every lane and only
+		 * store the active() ones. Nothing is marked as changed.
+		 *
+		 * Entities with the same components are next to each other after
+		 * compact(), so most packets are full() then.
+		 */
+		template<typename ...Ts, typename F>
+		void each_packet(F&& fn) {
+			using packet_type = Packet<Ts...>;
+			constexpr size_t W = packet_type::WIDTH;
+
+			u64 mask = this->get_components_mask<Ts...>();
+			size_t n = this->es.entities.size();
+
+			for (size_t base = 0; base < n; base += W) {
+				packet_type p;
+				p.size = std::min(W, n - base);
+				p.mask = 0;
+				for (u32 i = 0; i < p.size; i++) {
+					auto& e = this->es.entities[base + i];
+					p.mask |= u32(e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(mask)) << i;
+				}
+
+				if (!p.mask)
+					continue;
+
+				p.handles = &this->es.owners[base];
+				p.data = std::tuple<Ts*...>(&this->cs.template get<Ts>(base)...);
+				fn(p);
+			}
+		}
+
+		/**
+		 * Call fn(handle, Ts&...) on every entity with the Ts components,
+		 * spread over the job pool. The slots are split in chunks of at
+		 * least @grain that start and end on cache line boundaries in
+		 * every Ts column, so no two threads ever write to the same line.
+		 * fn must only touch the components it is given.
+		 *
+		 * @align_lines false keeps @grain as is, see bench/parallel_each.cc.
+		 */
+		template<typename ...Ts, typename F>
+		void parallel_each(F&& fn, size_t grain = 1024, bool align_lines = true) {
+			static_assert(sizeof...(Ts) > 0, "parallel_each needs at least one component");
+
+			// line_elements() are powers of two, the largest is a
+			// multiple of all the others
+			if (align_lines)
+				grain = utils::jobs::align_grain(grain, std::max({utils::jobs::line_elements(sizeof(Ts))...}));
+
+			u64 mask = this->get_components_mask<Ts...>();
+			this->jobs().parallel_for(this->es.entities.size(), grain, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					auto& e = this->es.entities[i];
+					if (e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(mask))
+						fn(this->es.owners[i], this->cs.template get<Ts>(i)...);
+				}
+			});
+		}
+
+		/**
+		 * Fold every entity with the Ts components into a T, in parallel
+		 * and yet reproducibly: map(handle, const Ts&...) turns an entity
+		 * into a T, and combine(T, T) merges two of them.
+		 *
+		 * The slots are cut in chunks of @chunk, whatever the number of
+		 * threads. Each chunk is folded in slot order, then the chunk
+		 * results are merged pairwise in a fixed tree, and the result is
+		 * finally combined with @init. combine must be associative for
+		 * the result to be the one of a plain loop, but even when it
+		 * isn't (floating point sums) the result only depends on the
+		 * order of the slots, which compact() changes.
+		 */
+		template<typename ...Ts, typename T, typename Map, typename Combine>
+		T reduce(T init, Map&& map, Combine&& combine, size_t chunk = 4096) {
+			if (chunk == 0)
+				chunk = 1;
+
+			u64 mask = this->get_components_mask<Ts...>();
+			size_t n = this->es.entities.size();
+
+			// chunks without entities to map have no value
+			std::vector<utils::jobs::Padded<std::optional<T>>> partials((n + chunk - 1) / chunk);
+
+			this->jobs().parallel_for(partials.size(), 1, [&](size_t begin, size_t end) {
+				for (size_t c = begin; c < end; c++) {
+					std::optional<T>& acc = partials[c].value;
+
+					for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) {
+						auto& e = this->es.entities[i];
+						if (!e.isflag(INTERNAL_FLAG_ALIVE) || !e.checkmask(mask))
+							continue;
+
+						T v = map(this->es.owners[i], std::as_const(this->cs.template get<Ts>(i))...);
+						acc = acc ? combine(std::move(*acc), std::move(v)) : std::move(v);
+					}
+				}
+			});
+
+			// merge neighbours, then neighbours of neighbours...
+			for (size_t step = 1; step < partials.size(); step *= 2) {
+				for (size_t i = 0; i + step < partials.size(); i += 2 * step) {
+					auto& left = partials[i].value;
+					auto& right = partials[i + step].value;
+
+					if (left && right)
+						left = combine(std::move(*left), std::move(*right));
+					else if (right)
+						left = std::move(right);
+				}
+			}
+
+			if (partials.empty() || !partials[0].value)
+				return init;
+			return combine(std::move(init), std::move(*partials[0].value));
+		}
+
+		/**
+		 * Close the holes left by killed entities, sort the live ones by
+		 * component mask and release the memory of the freed tail. Handles
+		 * stay valid, only the slots behind them move.
+		 *
+		 * With a non zero @budget the pass is incremental: it stops once
+		 * the budget is spent and resumes on the next call, always moving
+		 * forward a little. Returns true when the pass is finished.
+		 * Entities may be spawned or killed between two calls, a hole
+		 * created behind the pass is just left for the next one, and the
+		 * sort goes by the masks the entities had when it started.
+		 */
+		bool compact(std::chrono::nanoseconds budget = std::chrono::nanoseconds::zero()) {
+			using clock = std::chrono::steady_clock;
+			auto deadline = clock::now() + budget;
+			auto spent = [&](u32 steps) {
+				return budget != budget.zero() && steps % 64 == 0 &&
+					clock::now() >= deadline;
+			};
+
+			auto& ents = this->es.entities;
+			auto& c = this->compaction;
+
+			if (c.phase == Compaction::IDLE) {
+				c.lo = 0;
+				c.hi = ents.size();
+				c.phase = Compaction::CLOSE_HOLES;
+			}
+
+			u32 steps = 0;
+			while (c.phase == Compaction::CLOSE_HOLES) {
+				c.hi = std::min<u32>(c.hi, ents.size());
+
+				while (c.lo < c.hi && ents[c.lo].isflag(INTERNAL_FLAG_ALIVE))
+					c.lo++;
+				while (c.hi > c.lo && !ents[c.hi - 1].isflag(INTERNAL_FLAG_ALIVE))
+					c.hi--;
+
+				if (c.lo >= c.hi) {
+					// the live entities are now the first c.lo slots
+					c.n = c.lo;
+					c.cursor = 0;
+					c.keys.resize(c.n);
+					c.phase = Compaction::COUNT;
+					break;
+				}
+
+				this->es.relocate(c.hi - 1, c.lo);
+				this->cs.relocate(c.hi - 1, c.lo);
+
+				if (spent(++steps))
+					return false;
+			}
+
+			// Stable counting sort of the first c.n slots by mask: count
+			// the entities of each mask, then place each slot after the
+			// ones of the smaller masks. perm[i] is the slot that goes to i.
+			while (c.phase == Compaction::COUNT) {
+				if (c.cursor == c.n) {
+					std::vector<u64> masks;
+					c.offsets.each([&](u64 mask, u32) {
+						masks.push_back(mask);
+					});
+					std::sort(masks.begin(), masks.end());
+
+					u32 offset = 0;
+					for (u64 mask : masks) {
+						u32 count = *c.offsets.find(mask);
+						c.offsets.insert(mask, offset);
+						offset += count;
+					}
+
+					c.perm.resize(c.n);
+					c.cursor = 0;
+					c.phase = Compaction::PLACE;
+					break;
+				}
+
+				u64 mask = ents[c.cursor].masks;
+				u32* count = c.offsets.find(mask);
+				c.offsets.insert(mask, count ? *count + 1 : 1);
+				c.keys[c.cursor++] = mask;
+
+				if (spent(++steps))
+					return false;
+			}
+
+			while (c.phase == Compaction::PLACE) {
+				if (c.cursor == c.n) {
+					c.done.assign(c.n, false);
+					c.cursor = 0;
+					c.cur = NO_CYCLE;
+					c.phase = Compaction::CYCLES;
+					break;
+				}
+
+				u32& offset = *c.offsets.find(c.keys[c.cursor]);
+				c.perm[offset++] = c.cursor++;
+
+				if (spent(++steps))
+					return false;
+			}
+
+			// apply perm in place by following its cycles, c.cur is the
+			// slot being filled in the cycle starting at c.cursor.
+			while (c.phase == Compaction::CYCLES) {
+				if (c.cur == NO_CYCLE) {
+					if (c.cursor == c.n) {
+						c.phase = Compaction::FINISH;
+						break;
+					}
+					if (c.done[c.cursor]) {
+						c.cursor++;
+						continue;
+					}
+					c.cur = c.cursor;
+				}
+
+				c.done[c.cur] = true;
+				u32 next = c.perm[c.cur];
+				if (next == c.cursor) {
+					c.cur = NO_CYCLE;
+					c.cursor++;
+				} else {
+					this->es.swap(c.cur, next);
+					this->cs.swap(c.cur, next);
+					c.cur = next;
+				}
+
+				if (spent(++steps))
+					return false;
+			}
+
+			u32 size = ents.size();
+			while (size > 0 && !ents[size - 1].isflag(INTERNAL_FLAG_ALIVE))
+				size--;
+
+			this->es.truncate(size);
+			this->cs.truncate(size);
+			this->hierarchy.repack();
+
+			c = Compaction();
+			return true;
+		}
+
+		// Report the memory used by the System and how full it is. Walks
+		// every slot, meant for tooling rather than every frame.
+		Stats stats() {
+			Stats st;
+			std::array<size_t, 64> counts {};
+			utils::hashmap::FlatMap<u64, size_t> population;
+
+			for (size_t i = 0; i < this->es.entities.size(); i++) {
+				Entity& e = this->es.entities[i];
+				if (!e.isflag(INTERNAL_FLAG_ALIVE)) {
+					st.dead++;
+					continue;
+				}
+
+				st.live++;
+				for (u64 m = e.masks, c = 0; m; m >>= 1, c++)
+					counts[c] += m & 1;
+
+				size_t* n = population.find(e.masks);
+				population.insert(e.masks, n ? *n + 1 : 1);
+			}
+
+			st.free_handles = this->es.entity_pool.size();
+			st.slots = this->es.entities.size();
+			st.stride = this->cs.stride();
+			st.bookkeeping = this->es.entities.capacity() * sizeof(Entity)
+				+ this->es.owners.capacity() * sizeof(handle_type)
+				+ this->es.slots.capacity() * sizeof(u32)
+				+ this->es.generations.capacity() * sizeof(u32)
+				+ this->cs.ticks.capacity() * sizeof(this->cs.ticks[0])
+				+ this->cs.fresh.capacity() * sizeof(u64);
+
+			u32 id = 0;
+			((st.components.push_back({id, sizeof(Cs), this->cs.template allocated<Cs>(),
+				counts[id] * sizeof(Cs), counts[id]}), id++), ...);
+
+			for (const ErasedColumn& column : this->cs.erased) {
+				st.components.push_back({id, column.info.size, column.allocated(),
+					counts[id] * column.stride, counts[id]});
+				id++;
+			}
+
+			population.each([&](u64 mask, size_t n) {
+				st.masks.push_back({mask, n});
+			});
+			std::sort(st.masks.begin(), st.masks.end());
+
+			return st;
+		}
+
+		/**
+		 * Set the Shared<T> component of @handle to @value, enabling it.
+		 * The value is interned: entities sharing equal values point to a
+		 * single copy, and each holds a 32 bit reference to it.
+		 */
+		template<typename T>
+		void share(handle_type handle, const T& value) {
+			auto& pool = this->shared_pool<T>();
+			u32 ref = pool.intern(value);
+
+			this->release_shared<Shared<T>>(this->es.slot(handle));
+			this->component<Shared<T>>(handle).ref = ref;
+			this->enable_component<Shared<T>>(handle);
+		}
+
+		// The value of the Shared<T> component of @handle, shared with
+		// every entity having an equal one, hence read only.
+		template<typename T>
+		const T& shared(handle_type handle) {
+			return this->shared_pool<T>().get(this->component<Shared<T>>(handle).ref);
+		}
+
+		/**
+		 * Copy on write: call fn(T&) on a copy of the Shared<T> value of
+		 * @handle and share() the result, the other entities keeping the
+		 * old value.
+		 */
+		template<typename T, typename F>
+		void modify_shared(handle_type handle, F&& fn) {
+			T value = this->shared<T>(handle);
+			fn(value);
+			this->share<T>(handle, value);
+		}
+
+		/**
+		 * Call fn(value, handles, n) once per distinct Shared<T> value,
+		 * with the @n entities having the Ts components and that value,
+		 * so per-value setup is done once per group.
+		 */
+		template<typename T, typename ...Ts, typename F>
+		void each_shared(F&& fn) {
+			u64 mask = this->get_components_mask<Shared<T>, Ts...>();
+			std::vector<std::pair<u32, handle_type>> members;
+
+			for (size_t i = 0; i < this->es.entities.size(); i++) {
+				auto& e = this->es.entities[i];
+				if (e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(mask))
+					members.push_back({this->cs.template get<Shared<T>>(i).ref, this->es.owners[i]});
+			}
+
+			utils::radix::sort(members, [](const std::pair<u32, handle_type>& m) { return u64(m.first); });
+
+			std::vector<handle_type> group;
+			for (size_t i = 0; i < members.size(); i++) {
+				group.push_back(members[i].second);
+				if (i + 1 == members.size() || members[i + 1].first != members[i].first) {
+					fn(this->shared_pool<T>().get(members[i].first), group.data(), group.size());
+					group.clear();
+				}
+			}
+		}
+
+		// distinct Shared<T> values in use
+		template<typename T>
+		size_t shared_count() {
+			return this->shared_pool<T>().live;
+		}
+
+		/**
+		 * Relations link entities in pairs, many to many: relate<R>(a, b)
+		 * adds the pair R(a, b), with R any type naming the relation
+		 * (struct Likes {}, struct ChildOf {}...). Pairs are gone once
+		 * either entity is killed. Returns false if the pair was already
+		 * there.
+		 */
+		template<typename R>
+		bool relate(handle_type source, handle_type target) {
+			return this->relation<R>().add(source, target);
+		}
+
+		template<typename R>
+		bool unrelate(handle_type source, handle_type target) {
+			return this->relation<R>().remove(source, target);
+		}
+
+		template<typename R>
+		bool related(handle_type source, handle_type target) {
+			return this->relation<R>().contains(source, target);
+		}
+
+		// the entities @source has an R relation to
+		template<typename R>
+		const std::vector<handle_type>& targets(handle_type source) {
+			return this->relation<R>().targets(source);
+		}
+
+		// the entities with an R relation to @target, R(x, target)
+		template<typename R>
+		const std::vector<handle_type>& sources(handle_type target) {
+			return this->relation<R>().sources(target);
+		}
+
+		// query() restricted to the sources of R(x, @target), found
+		// through the reverse index rather than a scan of the store.
+		template<typename R, typename ...Ts>
+		std::vector<handle_type> query_related(handle_type target) {
+			u64 mask = this->get_components_mask<Ts...>();
+			std::vector<handle_type> result;
+
+			for (handle_type h : this->sources<R>(target))
+				if (this->es.entities[this->es.slot(h)].checkmask(mask))
+					result.push_back(h);
+
+			return result;
+		}
+
+		// Make @parent the parent of @child. Returns false if that would
+		// create a cycle.
+		bool set_parent(handle_type child, handle_type parent) {
+			return this->hierarchy.set_parent(child, parent);
+		}
+
+		void clear_parent(handle_type child) {
+			this->hierarchy.set_parent(child, Hierarchy::NONE);
+		}
+
+		handle_type parent(handle_type h) {
+			return this->hierarchy.contains(h) ? this->hierarchy.node(h).parent : Hierarchy::NONE;
+		}
+
+		handle_type first_child(handle_type h) {
+			return this->hierarchy.contains(h) ? this->hierarchy.node(h).first_child : Hierarchy::NONE;
+		}
+
+		handle_type next_sibling(handle_type h) {
+			return this->hierarchy.contains(h) ? this->hierarchy.node(h).next_sibling : Hierarchy::NONE;
+		}
+
+		/**
+		 * Call fn(parent, child) for every child of the hierarchy, level by
+		 * level, so a parent is always handled before its children. A
+		 * level only reads the one above it, so with @parallel each level
+		 * is split across the job pool.
+		 */
+		template<typename F>
+		void propagate(F&& fn, bool parallel = false) {
+			auto& levels = this->hierarchy.levels;
+
+			for (size_t d = 1; d < levels.size(); d++) {
+				auto& level = levels[d];
+				auto run = [&](size_t begin, size_t end) {
+					for (size_t i = begin; i < end; i++)
+						fn(this->hierarchy.nodes[EntityStore::index_of(level[i])].parent, level[i]);
+				};
+
+				if (parallel)
+					this->jobs().parallel_for(level.size(), 256, run);
+				else
+					run(0, level.size());
+			}
+		}
+
+		// The job pool used by the parallel parts of the System, started on
+		// first use.
+		utils::jobs::Pool& jobs() {
+			if (!this->pool)
+				this->pool = std::make_unique<utils::jobs::Pool>();
+			return *this->pool;
+		}
+
+		// Restart the job pool with @workers threads besides the caller.
+		// Not while a parallel part of the System is running.
+		void set_workers(size_t workers) {
+			this->pool = std::make_unique<utils::jobs::Pool>(workers);
+		}
+
+#ifdef ECS_COROUTINES
+		/**
+		 * Start @task on the next update(). Tasks are coroutines: they run
+		 * on the thread calling update(), so they can use the System
+		 * freely, until they co_await next_frame() or run_job(). Neither
+		 * blocks a thread, the task is just resumed by a later update().
+		 */
+		void spawn_task(utils::coro::Task&& task) {
+			this->new_tasks.push_back(std::move(task));
+		}
+
+		// Awaitable that resumes the task on the next update().
+		struct NextFrame {
+			System* system;
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> h) {
+				this->system->next_frame_waiters.push_back(h);
+			}
+
+			void await_resume() const noexcept { }
+		};
+
+		NextFrame next_frame() {
+			return {this};
+		}
+
+		/**
+		 * Awaitable that runs fn() on the job pool and resumes the task on
+		 * the first update() after it's done, the value of the co_await
+		 * being the one returned by fn().
+		 */
+		template<typename F>
+		struct Job {
+			using result_type = std::invoke_result_t<F&>;
+
+			System* system;
+			F fn;
+			std::optional<std::conditional_t<std::is_void_v<result_type>, bool, result_type>> result;
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> h) {
+				auto run = [this, h] {
+					if constexpr (std::is_void_v<result_type>) {
+						this->fn();
+					} else {
+						this->result.emplace(this->fn());
+					}
+
+					std::lock_guard<std::mutex> lock(this->system->finished_mutex);
+					this->system->finished_jobs.push_back(h);
+				};
+
+				// a pool without workers never runs submitted jobs
+				if (this->system->jobs().size() == 0)
+					run();
+				else
+					this->system->jobs().submit(run);
+			}
+
+			result_type await_resume() {
+				if constexpr (!std::is_void_v<result_type>)
+					return std::move(*this->result);
+			}
+		};
+
+		template<typename F>
+		Job<std::decay_t<F>> run_job(F&& fn) {
+			return {this, std::forward<F>(fn), std::nullopt};
+		}
+
+		// tasks spawned and not finished yet
+		size_t pending_tasks() const {
+			return this->tasks.size() + this->new_tasks.size();
+		}
+#endif
+
+		void update() {
+			auto now = std::chrono::steady_clock::now();
+
+#ifdef ECS_COROUTINES
+			this->resume_tasks();
+#endif
+
+			std::vector<Hook*> due;
+			for (auto& hook : this->update_hooks) {
+				if (++hook.waited < hook.schedule.every)
+					continue;
+
+				if (hook.schedule.hz > 0 && hook.ran &&
+						now - hook.last < std::chrono::duration<float>(1 / hook.schedule.hz))
+					continue;
+
+				hook.waited = 0;
+				hook.last = now;
+				hook.ran = true;
+				due.push_back(&hook);
+			}
+
+			// runs of resource hooks with no conflicting accesses run
+			// together, every other hook on its own
+			for (size_t i = 0, n; i < due.size(); i += n) {
+				u64 reads = due[i]->reads, writes = due[i]->writes;
+				n = 1;
+
+				while (due[i]->declared && i + n < due.size() && due[i + n]->declared) {
+					Hook* next = due[i + n];
+					if ((next->writes & (reads | writes)) || (next->reads & writes))
+						break;
+
+					reads |= next->reads;
+					writes |= next->writes;
+					n++;
+				}
+
+				if (n == 1) {
+					due[i]->fn();
+				} else {
+					this->jobs().parallel_for(n, 1, [&](size_t begin, size_t end) {
+						for (size_t j = begin; j < end; j++)
+							due[i + j]->fn();
+					});
+				}
+			}
+
+			this->flush_events();
+			this->sync_spatial_index();
+			this->cs.swap_buffers();
+			this->tick++;
+		}
+
+		/**
+		 * External ids (database rows, network ids...) can be bound to
+		 * entities and looked up through a flat hash index. Each entity
+		 * has at most one id, binding a new one replaces the previous, and
+		 * the binding goes away when the entity is killed. An id is bound
+		 * to one entity at most too, binding it again takes it from the
+		 * previous one. Dead and stale handles are ignored, their index
+		 * may belong to another entity by now.
+		 */
+		void bind_id(handle_type h, u64 id) {
+			if (!this->es.alive(h))
+				return;
+
+			this->unbind_id(h);
+			if (const handle_type* holder = this->id_index.find(id))
+				this->unbind_id(*holder);
+
+			u32 i = EntityStore::index_of(h);
+			if (i >= this->ids.size())
+				this->ids.resize(i + 1, {0, false});
+
+			this->ids[i] = {id, true};
+			this->id_index.insert(id, h);
+		}
+
+		void unbind_id(handle_type h) {
+			u32 i = EntityStore::index_of(h);
+			if (!this->es.alive(h) || i >= this->ids.size() || !this->ids[i].second)
+				return;
+
+			// the id may have been taken by another entity since
+			const handle_type* holder = this->id_index.find(this->ids[i].first);
+			if (holder && *holder == h)
+				this->id_index.erase(this->ids[i].first);
+			this->ids[i].second = false;
+		}
+
+		// the entity bound to @id, or EntityStore::NONE
+		handle_type find_by_id(u64 id) const {
+			const handle_type* h = this->id_index.find(id);
+			return h ? *h : EntityStore::NONE;
+		}
+
+		// find_by_id() over @n ids, prefetching the index a few ids ahead
+		// of the lookups.
+		void find_by_ids(const u64* ids, size_t n, handle_type* out) const {
+			const size_t ahead = 8;
+
+			for (size_t i = 0; i < std::min(n, ahead); i++)
+				this->id_index.prefetch(ids[i]);
+
+			for (size_t i = 0; i < n; i++) {
+				if (i + ahead < n)
+					this->id_index.prefetch(ids[i + ahead]);
+				out[i] = this->find_by_id(ids[i]);
+			}
+		}
+
+		u64 current_tick() const {
+			return this->tick;
+		}
+
+		/**
+		 * Change tracking: components written through component<C>() must
+		 * be marked with mark_changed<C>() (or written with set<C>()) for
+		 * the parts of the System that follow changes to notice them.
+		 */
+		template<typename C>
+		void mark_changed(handle_type h) {
+			constexpr u64 c = utils::metaprog::index<C, Cs...>();
+			u32 slot = this->es.slot(h);
+			this->cs.ticks[slot][c] = this->tick;
+			this->cs.fresh[slot] &= ~this->derivations[c].dependents;
+			this->follow_changes(u64(1) << c, h);
+		}
+
+		template<typename C>
+		void set(handle_type h, const C& value) {
+			this->acquire_shared(value);
+			this->release_shared<C>(this->es.slot(h));
+			this->component<C>(h) = value;
+			this->mark_changed<C>(h);
+		}
+
+		// whether the C component of @h was marked as changed after @since
+		template<typename C>
+		bool changed_since(handle_type h, u64 since) {
+			return this->cs.ticks[this->es.slot(h)][utils::metaprog::index<C, Cs...>()] > since;
+		}
+
+		/**
+		 * Declare D as derived from the Inputs components: fn(D&, const
+		 * Inputs&...) computes it. D is not computed eagerly but when read
+		 * through derived<D>() (or update_derived<D>()), and only if one of
+		 * the Inputs was marked as changed since D was last computed, or
+		 * if it never was. Inputs may be derived themselves, they are
+		 * brought up to date first. D is enabled and marked as changed
+		 * when computed, and shouldn't be written any other way.
+		 *
+		 * Ticks don't order the changes made within one tick, so instead
+		 * of comparing them, marking an input as changed clears the fresh
+		 * bit of D on that entity and computing D sets it. The tick is
+		 * never bumped here.
+		 */
+		template<typename D, typename ...Inputs, typename F>
+		void derive(F&& fn) {
+			static_assert(!utils::metaprog::is_one_of<D, Inputs...>::value,
+					"a component can't be derived from itself");
+
+			constexpr u64 d = utils::metaprog::index<D, Cs...>();
+
+			Derivation& derivation = this->derivations[d];
+			derivation.inputs = this->get_components_mask<Inputs...>();
+			((this->derivations[utils::metaprog::index<Inputs, Cs...>()].dependents |= u64(1) << d), ...);
+			derivation.refresh = [this, fn = std::forward<F>(fn)](u32 slot) mutable {
+				(this->refresh_derived(utils::metaprog::index<Inputs, Cs...>(), slot), ...);
+
+				Entity& e = this->es.entities[slot];
+				u64& fresh = this->cs.fresh[slot];
+				if (e.checkmask(u64(1) << d) && utils::bits::checkmask(fresh, u64(1) << d))
+					return;
+
+				fn(this->cs.template get<D>(slot), std::as_const(this->cs.template get<Inputs>(slot))...);
+
+				if (!e.checkmask(u64(1) << d)) {
+					this->record(Event::Add, u64(1) << d, this->es.owners[slot]);
+					e.setmask(d);
+				}
+
+				// D changed, what's derived from it is stale
+				this->cs.ticks[slot][d] = this->tick;
+				fresh = (fresh | u64(1) << d) & ~this->derivations[d].dependents;
+				this->follow_changes(u64(1) << d, this->es.owners[slot]);
+			};
+		}
+
+		// The derived component D of @h, recomputed first if needed. @h
+		// must have the inputs of D, or theirs for derived inputs.
+		template<typename D>
+		const D& derived(handle_type h) {
+			u32 slot = this->es.slot(h);
+			this->refresh_derived(utils::metaprog::index<D, Cs...>(), slot);
+			return this->cs.template get<D>(slot);
+		}
+
+		// Bring D up to date on every entity that has what it's computed
+		// from.
+		template<typename D>
+		void update_derived() {
+			constexpr u64 d = utils::metaprog::index<D, Cs...>();
+			u64 inputs = this->base_inputs(d);
+
+			for (size_t i = 0; i < this->es.entities.size(); i++) {
+				auto& e = this->es.entities[i];
+				if (e.isflag(INTERNAL_FLAG_ALIVE) && e.checkmask(inputs))
+					this->refresh_derived(d, i);
+			}
+		}
+
+		/**
+		 * File every entity with a P component in a uniform grid of
+		 * @cell_size wide cells. The grid follows the changes of P (see
+		 * mark_changed()) and is brought up to date by update() and by
+		 * the spatial queries.
+		 */
+		template<typename P>
+		void enable_spatial_index(float cell_size) {
+			this->spatial = std::make_unique<SpatialGrid>(cell_size);
+			this->spatial_component = utils::metaprog::index<P, Cs...>();
+			this->locate = &System::position_at<P>;
+			this->spatial_dirty.clear();
+
+			auto& ents = this->es.entities;
+			for (size_t i = 0; i < ents.size(); i++)
+				if (ents[i].isflag(INTERNAL_FLAG_ALIVE) && ents[i].checkmask(u64(1) << this->spatial_component))
+					this->spatial->file(this->es.owners[i], (this->*locate)(i));
+		}
+
+		// Refile the entities whose P was changed, enabled or disabled
+		// since the last call.
+		void sync_spatial_index() {
+			if (!this->spatial)
+				return;
+
+			u64 bit = u64(1) << this->spatial_component;
+			for (handle_type h : this->spatial_dirty) {
+				// killed entities are taken out by kill_entity()
+				if (!this->es.alive(h))
+					continue;
+
+				u32 slot = this->es.slot(h);
+				if (this->es.entities[slot].checkmask(bit))
+					this->spatial->file(h, (this->*locate)(slot));
+				else
+					this->spatial->remove(h);
+			}
+
+			this->spatial_dirty.clear();
+		}
+
+		// entities with the Ts components whose position is within @r of
+		// @center. Requires enable_spatial_index().
+		template<typename ...Ts>
+		std::vector<handle_type> query_radius(Vec3 center, float r) {
+			Vec3 lo {center.x - r, center.y - r, center.z - r};
+			Vec3 hi {center.x + r, center.y + r, center.z + r};
+
+			return this->query_spatial<Ts...>(lo, hi, [&](Vec3 p) {
+				float dx = p.x - center.x, dy = p.y - center.y, dz = p.z - center.z;
+				return dx * dx + dy * dy + dz * dz <= r * r;
+			});
+		}
+
+		// entities with the Ts components whose position is within the box
+		// [@lo, @hi]. Requires enable_spatial_index().
+		template<typename ...Ts>
+		std::vector<handle_type> query_aabb(Vec3 lo, Vec3 hi) {
+			return this->query_spatial<Ts...>(lo, hi, [&](Vec3 p) {
+				return p.x >= lo.x && p.y >= lo.y && p.z >= lo.z &&
+					p.x <= hi.x && p.y <= hi.y && p.z <= hi.z;
+			});
+		}
+
+	public:
+		void set_update_hooks(std::vector<std::function<void(void)>>&& hooks) {
+			this->update_hooks.clear();
+			for (auto& f : hooks)
+				this->add_update_hook(std::move(f));
+		}
+
+		void add_update_hook(std::function<void(void)> fn, Schedule schedule = {}) {
+			Hook hook;
+			hook.fn = std::move(fn);
+			hook.schedule = schedule;
+			this->update_hooks.push_back(std::move(hook));
+		}
+
+		/**
+		 * Register a hook that only works on resources: @fn is called with
+		 * a const reference for each Read<T> and a reference for each
+		 * Write<T> of Access, in that order. The resources must already
+		 * be inserted, they are resolved once here and @fn gets direct
+		 * references from then on.
+		 *
+		 * Such a hook must not touch anything else of the System. In
+		 * exchange, consecutive resource hooks due in the same update()
+		 * run at the same time on the job pool, as long as none writes a
+		 * resource another one reads or writes.
+		 */
+		template<typename ...Access, typename F>
+		void add_resource_hook(F&& fn, Schedule schedule = {}) {
+			Hook hook;
+			std::tuple<std::remove_reference_t<typename Access::reference>*...> refs {
+				&this->resource<typename Access::type>()...};
+
+			hook.fn = [fn = std::forward<F>(fn), refs]() mutable {
+				std::apply([&](auto*... ptrs) { fn(*ptrs...); }, refs);
+			};
+			hook.schedule = schedule;
+			hook.declared = true;
+			(((Access::write ? hook.writes : hook.reads) |=
+				u64(1) << this->resources[utils::metaprog::type_id<typename Access::type>()].bit), ...);
+
+			this->update_hooks.push_back(std::move(hook));
+		}
+
+		/**
+		 * Register @fn to be called on every entity with the Ts components,
+		 * within the time budget of @schedule. When the budget runs out the
+		 * hook stops and the next update() resumes it where it left off;
+		 * once every entity has been handled it starts over on the next
+		 * update(). Entities spawned, killed or moved by compact() while a
+		 * sweep is in progress may be missed or handled twice by it.
+		 */
+		template<typename ...Ts>
+		void add_update_hook(std::function<void(handle_type)> fn, Schedule schedule) {
+			u64 mask = this->get_components_mask<Ts...>();
+			auto budget = schedule.budget;
+
+			this->add_update_hook([this, fn = std::move(fn), mask, budget, cursor = size_t(0)]() mutable {
+				using clock = std::chrono::steady_clock;
+				auto deadline = clock::now() + budget;
+				auto& ents = this->es.entities;
+
+				u32 visited = 0;
+				for (; cursor < ents.size(); cursor++) {
+					if (budget != budget.zero() && ++visited % 16 == 0 && clock::now() >= deadline)
+						return;
+
+					if (ents[cursor].isflag(INTERNAL_FLAG_ALIVE) && ents[cursor].checkmask(mask))
+						fn(this->es.owners[cursor]);
+				}
+
+				cursor = 0;
+			}, schedule);
+		}
+
+		/**
+		 * Resources are values the System holds once, outside the entity
+		 * storage: a clock, the input state, the config... Each type has
+		 * at most one. Inserting a resource that is already there assigns
+		 * it, so references to it stay valid.
+		 */
+		template<typename T, typename ...Args>
+		T& insert_resource(Args&&... args) {
+			u64 id = utils::metaprog::type_id<T>();
+			if (id >= this->resources.size())
+				this->resources.resize(id + 1);
+
+			Resource& r = this->resources[id];
+			if (r.value) {
+				*static_cast<T*>(r.value.get()) = T(std::forward<Args>(args)...);
+			} else {
+				if (this->resource_count >= 64) {
+					std::fprintf(stderr, "ecs: no dependency bit left for a resource\n");
+					std::terminate();
+				}
+
+				r.value = {new T(std::forward<Args>(args)...), [](void* p) { delete static_cast<T*>(p); }};
+				r.bit = this->resource_count++;
+			}
+
+			return *static_cast<T*>(r.value.get());
+		}
+
+		// The T resource, which must have been inserted.
+		template<typename T>
+		T& resource() {
+			return *static_cast<T*>(this->resources[utils::metaprog::type_id<T>()].value.get());
+		}
+
+		// The T resource, or nullptr if there is none.
+		template<typename T>
+		T* try_resource() {
+			u64 id = utils::metaprog::type_id<T>();
+			return id < this->resources.size() ? static_cast<T*>(this->resources[id].value.get()) : nullptr;
+		}
+
+		// Get a reference to the Nth component of an entity
+		template<typename C>
+		C& component(handle_type h) {
+			return this->cs.template get<C>(this->es.slot(h));
+		}
+
+		/**
+		 * Access to DoubleBuffered<T> components: read() returns the value
+		 * of the previous frame, write() the one being built for this
+		 * frame. They never alias, so readers and writers can run in
+		 * parallel. update() swaps them at the end of the frame.
+		 */
+		template<typename T>
+		const T& read(handle_type h) {
+			return this->cs.template previous<T>(this->es.slot(h));
+		}
+
+		template<typename T>
+		T& write(handle_type h) {
+			this->mark_changed<DoubleBuffered<T>>(h);
+			return this->cs.template current<T>(this->es.slot(h));
+		}
+
+		/**
+		 * A sorted view keeps the entities with a C component ordered by
+		 * key(component) across updates. Each refresh only recomputes the
+		 * keys of the entities whose C was marked as changed or enabled
+		 * since the last one (see mark_changed()): when few did they are
+		 * merged back into the existing order, otherwise the view is radix
+		 * sorted again.
+		 * Returns the id of the view, for each_sorted().
+		 */
+		template<typename C, typename F>
+		u32 sorted_view(F key) {
+			SortedView view;
+			view.component = utils::metaprog::index<C, Cs...>();
+			view.key = [this, key](size_t slot) {
+				return utils::radix::ordered(key(this->cs.template get<C>(slot)));
+			};
+
+			this->sorted_components |= u64(1) << view.component;
+			this->sorted_views.push_back(std::move(view));
+			return this->sorted_views.size() - 1;
+		}
+
+		// Call fn(handle, component) in key order on every entity of @view.
+		template<typename C, typename F>
+		void each_sorted(u32 view, F&& fn) {
+			this->refresh(this->sorted_views[view]);
+
+			for (const auto& entry : this->sorted_views[view].entries)
+				fn(entry.handle, this->component<C>(entry.handle));
+		}
+
+		// component<C>() for a handle that may be dead or stale, or whose
+		// C component may not be enabled.
+		template<typename C>
+		Result<C&, EcsError> try_component(handle_type h) {
+			if constexpr (CHECKED_ACCESS) {
+				auto valid = this->validate(h);
+				if (valid.isErr())
+					return types::Err<EcsError>(valid.unwrapErr());
+
+				u64 bit = u64(1) << utils::metaprog::index<C, Cs...>();
+				if (!this->es.entities[this->es.slot(h)].checkmask(bit))
+					return types::Err<EcsError>(EcsError::ComponentNotEnabled);
+			}
+
+			return types::Ok<C&>(this->component<C>(h));
+		}
+
+		template<typename ...Ts>
+		Result<void, EcsError> try_enable_components(handle_type h) {
+			if constexpr (CHECKED_ACCESS) {
+				auto valid = this->validate(h);
+				if (valid.isErr())
+					return valid;
+			}
+
+			this->enable_components<Ts...>(h);
+			return types::Ok<void>();
+		}
+
+	// Private ECS related methods: helpers / internal definitions.
+	private:
+#ifdef ECS_COROUTINES
+		// Start the tasks spawned since the last update() and resume the
+		// ones waiting for this frame or whose job is done.
+		void resume_tasks() {
+			std::vector<std::coroutine_handle<>> ready;
+			ready.swap(this->next_frame_waiters);
+			{
+				std::lock_guard<std::mutex> lock(this->finished_mutex);
+				ready.insert(ready.end(), this->finished_jobs.begin(), this->finished_jobs.end());
+				this->finished_jobs.clear();
+			}
+
+			// tasks spawned by the ones resumed here start next time
+			std::vector<utils::coro::Task> starting;
+			starting.swap(this->new_tasks);
+			for (auto& task : starting) {
+				task.resume();
+				this->tasks.push_back(std::move(task));
+			}
+
+			for (auto h : ready)
+				h.resume();
+
+			this->tasks.erase(std::remove_if(this->tasks.begin(), this->tasks.end(),
+				[](const utils::coro::Task& t) { return t.done(); }), this->tasks.end());
+		}
+#endif
+
+		Result<void, EcsError> validate(handle_type h) {
+			u32 i = EntityStore::index_of(h);
+
+			if (EntityStore::shard_of(h) != this->es.shard)
+				return types::Err<EcsError>(EcsError::WrongShard);
+			if (i >= this->es.slots.size())
+				return types::Err<EcsError>(EcsError::DeadEntity);
+
+			// killing bumps the generation at once, the handle is only
+			// stale once its index belongs to a live entity again
+			if (this->es.generations[i] != EntityStore::generation_of(h)) {
+				u32 slot = this->es.slots[i];
+				bool reused = slot != EntityStore::NO_SLOT &&
+					this->es.entities[slot].isflag(INTERNAL_FLAG_ALIVE);
+				return types::Err<EcsError>(reused ? EcsError::StaleGeneration : EcsError::DeadEntity);
+			}
+			if (!this->es.alive(h))
+				return types::Err<EcsError>(EcsError::DeadEntity);
+
+			return types::Ok<void>();
+		}
+
+		template<typename P>
+		Vec3 position_at(size_t slot) {
+			return spatial_traits<P>::position(this->cs.template get<P>(slot));
+		}
+
+		template<typename ...Ts, typename F>
+		std::vector<handle_type> query_spatial(Vec3 lo, Vec3 hi, F&& inside) {
+			this->sync_spatial_index();
+
+			u64 mask = this->get_components_mask<Ts...>() | (u64(1) << this->spatial_component);
+			std::vector<handle_type> query_result;
+
+			this->spatial->visit(lo, hi, [&](handle_type h) {
+				u32 slot = this->es.slot(h);
+				if (this->es.entities[slot].checkmask(mask) && inside((this->*locate)(slot)))
+					query_result.push_back(h);
+			});
+
+			return query_result;
+		}
+
+		template<typename T>
+		void enable_component(handle_type handle) {
+			constexpr u64 c = utils::metaprog::index<T, Cs...>();
+			Entity& e = this->es.entities[this->es.slot(handle)];
+
+			if (!e.checkmask(u64(1) << c))
+				this->record(Event::Add, u64(1) << c, handle);
+
+			e.setmask(c);
+			this->mark_changed<T>(handle);
+		}
+
+		template<typename T>
+		void disable_component(handle_type handle) {
+			constexpr u64 c = utils::metaprog::index<T, Cs...>();
+			Entity& e = this->es.entities[this->es.slot(handle)];
+
+			if (e.checkmask(u64(1) << c))
+				this->record(Event::Remove, u64(1) << c, handle);
+
+			e.clearmask(c);
+			this->follow_changes(u64(1) << c, handle);
+		}
+
+		struct SortedView {
+			struct Entry {
+				u64 key;
+				handle_type handle;
+			};
+
+			u64 component;
+			std::function<u64(size_t)> key;
+			std::vector<Entry> entries;
+
+			// handles whose component changed since the last refresh, once
+			// the view is built
+			std::vector<handle_type> dirty;
+			bool built = false;
+			// marks[i] == serial when the entity at handle index i changed
+			// during the current refresh
+			std::vector<u32> marks;
+			u32 serial = 0;
+		};
+
+		// Bring @view up to date, see sorted_view().
+		void refresh(SortedView& view) {
+			auto& ents = this->es.entities;
+			u64 bit = u64(1) << view.component;
+			u32 serial = ++view.serial;
+
+			if (view.marks.size() < this->es.slots.size())
+				view.marks.resize(this->es.slots.size(), 0);
+
+			// entities that joined the view or changed since last time,
+			// all of them the first time
+			std::vector<typename SortedView::Entry> changed;
+			auto add = [&](u32 slot) {
+				handle_type h = this->es.owners[slot];
+				u32& mark = view.marks[EntityStore::index_of(h)];
+				if (mark != serial && ents[slot].checkmask(bit)) {
+					mark = serial;
+					changed.push_back({view.key(slot), h});
+				}
+			};
+
+			if (view.built) {
+				for (handle_type h : view.dirty)
+					if (this->es.alive(h))
+						add(this->es.slot(h));
+			} else {
+				for (size_t i = 0; i < ents.size(); i++)
+					if (ents[i].isflag(INTERNAL_FLAG_ALIVE))
+						add(i);
+			}
+			view.dirty.clear();
+
+			// drop the entries that left the view or are about to be put
+			// back with their new key, keeping the others in order.
+			size_t kept = 0;
+			for (const auto& entry : view.entries) {
+				handle_type h = entry.handle;
+				if (this->es.alive(h) && view.marks[EntityStore::index_of(h)] != serial &&
+						ents[this->es.slot(h)].checkmask(bit))
+					view.entries[kept++] = entry;
+			}
+			view.entries.resize(kept);
+
+			auto by_key = [](const auto& a, const auto& b) { return a.key < b.key; };
+
+			if (changed.size() * 16 < kept) {
+				std::sort(changed.begin(), changed.end(), by_key);
+				view.entries.insert(view.entries.end(), changed.begin(), changed.end());
+				std::inplace_merge(view.entries.begin(), view.entries.begin() + kept,
+						view.entries.end(), by_key);
+			} else {
+				view.entries.insert(view.entries.end(), changed.begin(), changed.end());
+				utils::radix::sort(view.entries, [](const auto& e) { return e.key; });
+			}
+
+			view.built = true;
+		}
+
+		// Buffer @event for the observed components of @mask, on the @n
+		// contiguous handles starting at @handle.
+		void record(Event event, u64 mask, handle_type handle, size_t n = 1) {
+			mask &= this->observed[size_t(event)];
+			for (size_t c = 0; mask; c++, mask >>= 1) {
+				if (mask & 1) {
+					auto& batch = this->events[c][size_t(event)];
+					for (size_t i = 0; i < n; i++)
+						batch.push_back(handle + i);
+				}
+			}
+		}
+
+		// Call fn(static_cast<C*>(nullptr)) with C the @index th component
+		// type. Returns false if there is no such component or fn does.
+		template<typename F>
+		bool visit_component(u32 index, F&& fn) {
+			return this->visit_component(index, fn, std::index_sequence_for<Cs...>());
+		}
+
+		template<typename F, size_t ...I>
+		bool visit_component(u32 index, F& fn, std::index_sequence<I...>) {
+			bool result = false;
+			((index == I && (result = fn(static_cast<Cs*>(nullptr)), true)) || ...);
+			return result;
+		}
+
+		template<
+			typename ...Ts>
+		u64 get_components_mask(){ 
+			u64 mask = 0;
+			if constexpr (sizeof...(Ts) > 0)
+				this->_get_components_mask<Ts...>(mask);
+			return mask;
+		}
+
+		template<
+			typename First,
+			typename ...Rest>
+		void _get_components_mask(u64& history){ 
+			history |= (u64(1) << utils::metaprog::index<First, Cs...>());
+			if constexpr (sizeof...(Rest) == 0)
+				return;
+			else
+				this->_get_components_mask<Rest...>(history);
+		}
+
+		/*
+		 * UNUSED
+		template<
+			typename First,
+			typename ...Ts>
+		std::vector<handle_type> component_indexes() {
+			std::vector<handle_type> is;
+			this->component_indexes_internal<First, Ts...>(is);
+			return is;
+		}
+
+		template<
+			typename First,
+			typename ...Ts>
+		void component_indexes_internal(std::vector<handle_type>& history) {
+			history.push_back(utils::metaprog::index<First, Cs...>());
+			if constexpr (sizeof...(Ts) == 0)
+				return;
+			else
+				this->component_indexes_internal<Ts...>(history);
+		}
+		*/
+
+	private:
+		EntityStore es;
+		ComponentStore<Cs...> cs;
+
+		static constexpr u32 NO_CYCLE = ~u32(0);
+
+		// state of an incremental compact() pass
+		struct Compaction {
+			enum { IDLE, CLOSE_HOLES, COUNT, PLACE, CYCLES, FINISH } phase = IDLE;
+			u32 lo = 0;
+			u32 hi = 0;
+
+			// sort of the first n slots, see compact()
+			u32 n = 0;
+			u32 cursor = 0;
+			u32 cur = NO_CYCLE;
+			std::vector<u64> keys;
+			std::vector<u32> perm;
+			std::vector<bool> done;
+			// entities per mask, then where the next one of each goes
+			utils::hashmap::FlatMap<u64, u32> offsets;
+		} compaction;
+
+		struct Prefab {
+			typename ComponentStore<Cs...>::ComponentSet set;
+			u64 mask;
+		};
+		std::vector<Prefab> prefabs;
+
+		std::vector<SortedView> sorted_views;
+		// components with a sorted view
+		u64 sorted_components = 0;
+
+		Hierarchy hierarchy;
+
+#ifdef ECS_COROUTINES
+		std::vector<utils::coro::Task> tasks;
+		std::vector<utils::coro::Task> new_tasks;
+
+		// tasks to resume on the next update(): the ones that awaited
+		// next_frame(), and the ones whose job is done, the latter being
+		// pushed by the workers
+		std::vector<std::coroutine_handle<>> next_frame_waiters;
+		std::vector<std::coroutine_handle<>> finished_jobs;
+		std::mutex finished_mutex;
+#endif
+
+		// declared after the tasks, so it's destroyed (and its jobs are
+		// run) before them
+		std::unique_ptr<utils::jobs::Pool> pool;
+
+		// per component and per Event: the observers and the handles
+		// waiting to be delivered to them
+		std::array<std::array<std::vector<observer_type>, 3>, sizeof...(Cs)> observers;
+		std::array<std::array<std::vector<handle_type>, 3>, sizeof...(Cs)> events;
+		// per Event, the components with at least one observer
+		std::array<u64, 3> observed {};
+
+		// bumped by update(), stamped by mark_changed(). 64 bits wide, so
+		// comparisons of stamps never see it wrap around
+		u64 tick = 1;
+
+		// external id -> entity, and the id bound to each handle index
+		utils::hashmap::FlatMap<u64, handle_type> id_index;
+		std::vector<std::pair<u64, bool>> ids;
+
+		std::unique_ptr<SpatialGrid> spatial;
+		u64 spatial_component = 0;
+		Vec3 (System::*locate)(size_t) = nullptr;
+		// handles whose spatial component changed since the last sync
+		std::vector<handle_type> spatial_dirty;
+
+		// Queue the @n handles from @first for sync_spatial_index() and
+		// the sorted views whose component is in @mask.
+		void follow_changes(u64 mask, handle_type first, size_t n = 1) {
+			if (this->spatial && (mask >> this->spatial_component & 1))
+				for (size_t i = 0; i < n; i++)
+					this->spatial_dirty.push_back(first + i);
+
+			if (!(mask & this->sorted_components))
+				return;
+			for (auto& view : this->sorted_views) {
+				if (!view.built || !(mask >> view.component & 1))
+					continue;
+
+				for (size_t i = 0; i < n; i++)
+					view.dirty.push_back(first + i);
+
+				// a view left unread rescans the store rather than growing
+				if (view.dirty.size() > this->es.entities.size()) {
+					view.dirty.clear();
+					view.built = false;
+				}
+			}
+		}
+		
+	private:
+		struct Hook {
+			std::function<void(void)> fn;
+			Schedule schedule;
+			// updates since the hook last ran
+			u32 waited = 0;
+			std::chrono::steady_clock::time_point last;
+			bool ran = false;
+			// resource hook, and the bits of the resources it reads and
+			// writes
+			bool declared = false;
+			u64 reads = 0;
+			u64 writes = 0;
+		};
+
+		std::vector<Hook> update_hooks;
+
+		struct Resource {
+			std::unique_ptr<void, void (*)(void*)> value {nullptr, nullptr};
+			// bit of the resource in the reads and writes of the hooks
+			u32 bit = 0;
+		};
+
+		// indexed by utils::metaprog::type_id()
+		std::vector<Resource> resources;
+		u32 resource_count = 0;
+
+		// per component, how to compute it if it's derived and what's
+		// derived from it, see derive()
+		struct Derivation {
+			u64 inputs = 0;
+			u64 dependents = 0;
+			std::function<void(u32)> refresh;
+		};
+
+		std::array<Derivation, sizeof...(Cs)> derivations;
+
+		void refresh_derived(u64 component, u32 slot) {
+			if (this->derivations[component].refresh)
+				this->derivations[component].refresh(slot);
+		}
+
+		// the components derived @component is ultimately computed from,
+		// going through its derived inputs
+		u64 base_inputs(u64 component) {
+			u64 base = 0;
+			u64 inputs = this->derivations[component].inputs;
+
+			for (u64 c = 0; inputs; c++, inputs >>= 1) {
+				if (!(inputs & 1))
+					continue;
+				base |= this->derivations[c].refresh ? this->base_inputs(c) : u64(1) << c;
+			}
+
+			return base;
+		}
+
+		// one SharedPool per Shared<T> component, empty for the others
+		std::tuple<typename shared_pool_of<Cs>::type...> shared_pools;
+
+		template<typename T>
+		SharedPool<T>& shared_pool() {
+			return std::get<SharedPool<T>>(this->shared_pools);
+		}
+
+		// Take @n more references to the Shared value of @c, if C is
+		// shared.
+		template<typename C>
+		void acquire_shared(const C& c, u32 n = 1) {
+			if constexpr (is_shared<C>::value) {
+				if (c.ref != C::NONE)
+					std::get<typename shared_pool_of<C>::type>(this->shared_pools).acquire(c.ref, n);
+			}
+		}
+
+		// Drop the Shared value reference held at @slot, if C is shared.
+		template<typename C>
+		void release_shared(u32 slot) {
+			if constexpr (is_shared<C>::value) {
+				C& c = this->cs.template get<C>(slot);
+				if (c.ref != C::NONE)
+					std::get<typename shared_pool_of<C>::type>(this->shared_pools).release(c.ref);
+				c.ref = C::NONE;
+			}
+		}
+
+		// indexed by utils::metaprog::type_id() of the relation type,
+		// created on first use
+		std::vector<std::unique_ptr<Relations>> relations;
+
+		template<typename R>
+		Relations& relation() {
+			u64 id = utils::metaprog::type_id<R>();
+			if (id >= this->relations.size())
+				this->relations.resize(id + 1);
+			if (!this->relations[id])
+				this->relations[id] = std::make_unique<Relations>();
+			return *this->relations[id];
+		}
+	};
+
+	/**
+	 * A set of independent Systems, the shards, each meant to be driven by
+	 * its own thread. Entities move between shards through one SPSC queue
+	 * per (source, destination) pair: migrate() is called by the thread
+	 * driving the source shard and receive() by the one driving the
+	 * destination, so no queue ever sees more than one producer or
+	 * consumer. Handles carry their shard, so owner() finds the System of
+	 * any handle.
+	 */
+	template<typename ...Cs>
+	class Shards {
+	public:
+		using system_type = System<Cs...>;
+		using handle_type = typename system_type::handle_type;
+		using Migrant = typename system_type::Migrant;
+
+		// the shard takes 8 bits of the handles
+		static constexpr size_t MAX_SHARDS = 256;
+
+		explicit Shards(size_t n, size_t queue_capacity = 1024)
+			: pool(std::min(n - 1, utils::jobs::Pool::default_workers())) {
+			if (n == 0 || n > MAX_SHARDS) {
+				std::fprintf(stderr, "ecs: a Shards holds between 1 and %zu shards\n", MAX_SHARDS);
+				std::terminate();
+			}
+
+			for (size_t i = 0; i < n; i++)
+				this->shards.push_back(std::make_unique<system_type>(u8(i)));
+			for (size_t i = 0; i < n * n; i++)
+				this->queues.push_back(std::make_unique<utils::spsc::Queue<Migrant>>(queue_capacity));
+		}
+
+		size_t size() const {
+			return this->shards.size();
+		}
+
+		system_type& shard(size_t i) {
+			return *this->shards[i];
+		}
+
+		// the System @handle lives in
+		system_type& owner(handle_type handle) {
+			return *this->shards[EntityStore::shard_of(handle)];
+		}
+
+		/**
+		 * Take @handle out of its shard and queue it for shard @to, where
+		 * receive() spawns it under a new handle. Returns false, leaving the
+		 * entity where it is, if the queue to @to is full, and if @handle
+		 * is dead or @to isn't a shard.
+		 */
+		bool migrate(handle_type handle, u8 to) {
+			u8 from = EntityStore::shard_of(handle);
+			if (from >= this->shards.size() || to >= this->shards.size() ||
+					!this->shards[from]->alive(handle))
+				return false;
+
+			auto& queue = this->queue(from, to);
+			if (queue.full())
+				return false;
+
+			queue.push(this->shards[from]->emigrate(handle));
+			return true;
+		}
+
+		// migrate() @n handles of the same shard, stopping at the first one
+		// that can't be queued. Returns the number of entities queued.
+		size_t migrate(const handle_type* handles, size_t n, u8 to) {
+			size_t i = 0;
+			while (i < n && this->migrate(handles[i], to))
+				i++;
+			return i;
+		}
+
+		/**
+		 * Spawn in shard @to every entity queued for it so far, calling
+		 * arrived(new handle) on each. Returns the number of entities
+		 * received.
+		 */
+		size_t receive(u8 to, const std::function<void(handle_type)>& arrived = nullptr) {
+			system_type& system = *this->shards[to];
+			size_t n = 0;
+
+			for (size_t from = 0; from < this->shards.size(); from++) {
+				n += this->queue(from, to).drain([&](Migrant&& m) {
+					handle_type h = system.immigrate(std::move(m));
+					if (arrived)
+						arrived(h);
+				});
+			}
+
+			return n;
+		}
+
+		// Run update() on every shard in parallel, each one then receiving
+		// the entities migrated to it.
+		void update() {
+			this->pool.parallel_for(this->shards.size(), 1, [this](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					this->shards[i]->update();
+					this->receive(u8(i));
+				}
+			});
+		}
+
+	private:
+		utils::spsc::Queue<Migrant>& queue(size_t from, size_t to) {
+			return *this->queues[from * this->shards.size() + to];
+		}
+
+		std::vector<std::unique_ptr<system_type>> shards;
+
+		// queues[from * size() + to]
+		std::vector<std::unique_ptr<utils::spsc::Queue<Migrant>>> queues;
+
+		utils::jobs::Pool pool;
 	};
 };
 
@@ -3,11 +3,15 @@
 namespace utils {
 	namespace bits {
 		u64 setbit(u64 bitno, u64& x) {
-			x |= (1 << bitno);
+			x |= (u64(1) << bitno);
+			return x;
+		}
+		u64 clearbit(u64 bitno, u64& x) {
+			x &= ~(u64(1) << bitno);
 			return x;
 		}
 		bool isbiton(u64 bitno, u64 x) {
-			return x & (1 << bitno);
+			return x & (u64(1) << bitno);
 		}
 		bool checkmask(u64 x, u64 mask) {
 			return (x & mask) == mask;
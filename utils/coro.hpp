@@ -0,0 +1,77 @@
+#pragma once
+
+// coroutines need C++20, see the STD option of the Makefile
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <utility>
+#include <exception>
+#include <coroutine>
+
+namespace utils {
+    namespace coro {
+        /**
+         * A coroutine that returns nothing and is driven by whoever holds
+         * it: it starts suspended, runs until its next co_await on each
+         * resume(), and stays suspended once finished so done() can be
+         * checked. The frame is destroyed with the Task.
+         */
+        class Task {
+        public:
+            struct promise_type {
+                Task get_return_object() {
+                    return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+
+                std::suspend_always initial_suspend() noexcept {
+                    return {};
+                }
+
+                std::suspend_always final_suspend() noexcept {
+                    return {};
+                }
+
+                void return_void() { }
+
+                void unhandled_exception() {
+                    std::terminate();
+                }
+            };
+
+            Task(Task&& other) noexcept
+                : handle(std::exchange(other.handle, nullptr)) { }
+
+            Task& operator=(Task&& other) noexcept {
+                if (this != &other) {
+                    if (this->handle)
+                        this->handle.destroy();
+                    this->handle = std::exchange(other.handle, nullptr);
+                }
+                return *this;
+            }
+
+            Task(const Task&) = delete;
+            Task& operator=(const Task&) = delete;
+
+            ~Task() {
+                if (this->handle)
+                    this->handle.destroy();
+            }
+
+            bool done() const {
+                return !this->handle || this->handle.done();
+            }
+
+            void resume() {
+                this->handle.resume();
+            }
+
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle)
+                : handle(handle) { }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+    };
+};
+
+#endif
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <functional>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "types.hpp"
+
+namespace utils {
+    namespace hashmap {
+        /**
+         * Open addressing hash map in the style of Swiss tables: slots are
+         * split in groups of 16, each with 16 control bytes holding 7 bits
+         * of the hash of the key in the slot (or an empty / deleted
+         * marker). A lookup compares the 7 bits against a whole group of
+         * control bytes at once and only looks at the keys that match.
+         *
+         * Keys and values are stored inline, so both must be default
+         * constructible and cheap to move.
+         */
+        template<
+            typename K,
+            typename V,
+            typename Hash = std::hash<K>>
+        class FlatMap {
+        public:
+            static constexpr size_t GROUP = 16;
+
+            FlatMap() = default;
+
+            size_t size() const {
+                return this->count;
+            }
+
+            bool empty() const {
+                return this->count == 0;
+            }
+
+            void clear() {
+                this->ctrl.clear();
+                this->slots.clear();
+                this->count = 0;
+                this->tombstones = 0;
+            }
+
+            void reserve(size_t n) {
+                size_t cap = GROUP;
+                while (cap * 7 / 8 < n)
+                    cap *= 2;
+                if (cap > this->ctrl.size())
+                    this->rehash(cap);
+            }
+
+            V* find(const K& key) {
+                size_t i = this->find_index(key);
+                return i == NPOS ? nullptr : &this->slots[i].second;
+            }
+
+            const V* find(const K& key) const {
+                size_t i = this->find_index(key);
+                return i == NPOS ? nullptr : &this->slots[i].second;
+            }
+
+            // Insert @key, or overwrite its value if it is already there.
+            void insert(const K& key, const V& value) {
+                if (V* v = this->find(key)) {
+                    *v = value;
+                    return;
+                }
+
+                if ((this->count + this->tombstones + 1) * 8 > this->ctrl.size() * 7) {
+                    // grow if the map is really getting full, otherwise
+                    // rehashing in place is enough to get rid of tombstones
+                    size_t cap = this->ctrl.size();
+                    if (cap == 0)
+                        cap = GROUP;
+                    else if ((this->count + 1) * 16 > cap * 7)
+                        cap *= 2;
+                    this->rehash(cap);
+                }
+
+                this->place(key, value);
+            }
+
+            bool erase(const K& key) {
+                size_t i = this->find_index(key);
+                if (i == NPOS)
+                    return false;
+
+                this->ctrl[i] = DELETED;
+                this->slots[i] = Slot {};
+                this->count--;
+                this->tombstones++;
+                return true;
+            }
+
+            // Bring the first group @key probes into the cache.
+            void prefetch(const K& key) const {
+                if (this->ctrl.empty())
+                    return;
+
+                size_t group = (this->hash(key) >> 7) & (this->ctrl.size() / GROUP - 1);
+                __builtin_prefetch(&this->ctrl[group * GROUP]);
+                __builtin_prefetch(&this->slots[group * GROUP]);
+            }
+
+            template<typename F>
+            void each(F&& fn) const {
+                for (size_t i = 0; i < this->ctrl.size(); i++)
+                    if (this->ctrl[i] >= 0)
+                        fn(this->slots[i].first, this->slots[i].second);
+            }
+
+        private:
+            using Slot = std::pair<K, V>;
+
+            static constexpr i8 EMPTY = -128;
+            static constexpr i8 DELETED = -2;
+            static constexpr size_t NPOS = ~size_t(0);
+
+            u64 hash(const K& key) const {
+                // std::hash is often the identity, mix it so the low and
+                // high bits both carry information.
+                u64 h = Hash {}(key);
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                h *= 0xc4ceb9fe1a85ec53ULL;
+                h ^= h >> 33;
+                return h;
+            }
+
+            static i8 h2(u64 h) {
+                return i8(h & 0x7f);
+            }
+
+            static u32 lowest(u32 m) {
+                return __builtin_ctz(m);
+            }
+
+            // Bitmask of the control bytes of @group equal to @c.
+            u32 match(size_t group, i8 c) const {
+                const i8* g = &this->ctrl[group * GROUP];
+#ifdef __SSE2__
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+#else
+                u32 m = 0;
+                for (size_t i = 0; i < GROUP; i++)
+                    m |= u32(g[i] == c) << i;
+                return m;
+#endif
+            }
+
+            // Bitmask of the empty or deleted control bytes of @group.
+            u32 match_free(size_t group) const {
+                const i8* g = &this->ctrl[group * GROUP];
+#ifdef __SSE2__
+                // both markers have their high bit set, full slots don't
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+                return _mm_movemask_epi8(bytes);
+#else
+                u32 m = 0;
+                for (size_t i = 0; i < GROUP; i++)
+                    m |= u32(g[i] < 0) << i;
+                return m;
+#endif
+            }
+
+            // Visit the groups of the probe sequence of @h (triangular
+            // probing, which goes through every group) until fn returns true.
+            template<typename F>
+            void probe(u64 h, F&& fn) const {
+                size_t mask = this->ctrl.size() / GROUP - 1;
+                size_t group = (h >> 7) & mask;
+
+                for (size_t step = 1; step <= mask + 1; step++) {
+                    if (fn(group))
+                        return;
+                    group = (group + step) & mask;
+                }
+            }
+
+            size_t find_index(const K& key) const {
+                if (this->count == 0)
+                    return NPOS;
+
+                u64 h = this->hash(key);
+                size_t found = NPOS;
+
+                this->probe(h, [&](size_t group) {
+                    u32 m = this->match(group, h2(h));
+                    while (m) {
+                        size_t i = group * GROUP + lowest(m);
+                        if (this->slots[i].first == key) {
+                            found = i;
+                            return true;
+                        }
+                        m &= m - 1;
+                    }
+                    // an empty slot ends the probe sequence
+                    return this->match(group, EMPTY) != 0;
+                });
+
+                return found;
+            }
+
+            void place(const K& key, const V& value) {
+                u64 h = this->hash(key);
+
+                this->probe(h, [&](size_t group) {
+                    u32 m = this->match_free(group);
+                    if (!m)
+                        return false;
+
+                    size_t i = group * GROUP + lowest(m);
+                    if (this->ctrl[i] == DELETED)
+                        this->tombstones--;
+
+                    this->ctrl[i] = h2(h);
+                    this->slots[i] = Slot {key, value};
+                    this->count++;
+                    return true;
+                });
+            }
+
+            void rehash(size_t capacity) {
+                std::vector<i8> old_ctrl(capacity, EMPTY);
+                std::vector<Slot> old_slots(capacity);
+                std::swap(old_ctrl, this->ctrl);
+                std::swap(old_slots, this->slots);
+
+                this->count = 0;
+                this->tombstones = 0;
+
+                for (size_t i = 0; i < old_ctrl.size(); i++)
+                    if (old_ctrl[i] >= 0)
+                        this->place(old_slots[i].first, old_slots[i].second);
+            }
+
+            std::vector<i8> ctrl;
+            std::vector<Slot> slots;
+            size_t count = 0;
+            size_t tombstones = 0;
+        };
+    };
+};
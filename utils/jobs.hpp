@@ -0,0 +1,178 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "types.hpp"
+
+namespace utils {
+    namespace jobs {
+        // size of a cache line, and of the alignment that keeps two
+        // threads from writing to the same one
+        static constexpr size_t CACHE_LINE = 64;
+
+        // A T alone on its cache line(s), for counters and partial
+        // results written by different threads side by side.
+        template<typename T>
+        struct alignas(CACHE_LINE) Padded {
+            T value {};
+        };
+
+        // Elements of @size bytes in the smallest run that starts and
+        // ends on a cache line boundary, when the first one does.
+        constexpr size_t line_elements(size_t size) {
+            size_t n = 1;
+            while (n < CACHE_LINE && (n * size) % CACHE_LINE != 0)
+                n *= 2;
+            return n;
+        }
+
+        // @grain rounded up to a multiple of @step, see line_elements():
+        // chunks of a line aligned array then never share a cache line.
+        constexpr size_t align_grain(size_t grain, size_t step) {
+            return (std::max<size_t>(grain, 1) + step - 1) / step * step;
+        }
+        /**
+         * A fixed set of worker threads consuming a FIFO of jobs. The thread
+         * calling parallel_for() takes part in the work, so a pool with no
+         * workers just runs everything inline.
+         */
+        class Pool {
+        public:
+            // one worker per hardware thread, the caller being the last one
+            static size_t default_workers() {
+                size_t n = std::thread::hardware_concurrency();
+                return n > 1 ? n - 1 : 0;
+            }
+
+            explicit Pool(size_t workers = default_workers()) {
+                for (size_t i = 0; i < workers; i++)
+                    this->threads.emplace_back([this] { this->work(); });
+            }
+
+            Pool(const Pool&) = delete;
+            Pool& operator=(const Pool&) = delete;
+
+            ~Pool() {
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->stopping = true;
+                }
+                this->cv.notify_all();
+
+                for (auto& t : this->threads)
+                    t.join();
+            }
+
+            size_t size() const {
+                return this->threads.size();
+            }
+
+            void submit(std::function<void(void)> job) {
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->queue.push_back(std::move(job));
+                }
+                this->cv.notify_one();
+            }
+
+            /**
+             * Call fn(begin, end) over [0, n) in chunks of @grain elements
+             * and block until every chunk is done. The calling thread takes
+             * chunks too and only waits for the helpers that started: one
+             * still queued behind a long job finds the work gone and leaves
+             * without touching @fn.
+             */
+            void parallel_for(size_t n, size_t grain,
+                    const std::function<void(size_t, size_t)>& fn) {
+                if (grain == 0)
+                    grain = 1;
+
+                size_t chunks = (n + grain - 1) / grain;
+                if (chunks == 0)
+                    return;
+
+                size_t helpers = std::min(chunks, this->threads.size() + 1) - 1;
+                if (helpers == 0) {
+                    fn(0, n);
+                    return;
+                }
+
+                // outlives the call for the helpers that run late. Every
+                // thread hammers next, keep it off the line of the rest of
+                // the state.
+                struct State {
+                    Padded<std::atomic<size_t>> next;
+                    size_t running = 0;
+                    bool closed = false;
+                    std::mutex mutex;
+                    std::condition_variable done;
+                };
+                auto state = std::make_shared<State>();
+
+                auto drain = [&fn, n, grain, chunks](State& state) {
+                    size_t c;
+                    while ((c = state.next.value.fetch_add(1)) < chunks)
+                        fn(c * grain, std::min(n, (c + 1) * grain));
+                };
+
+                for (size_t i = 0; i < helpers; i++) {
+                    this->submit([state, drain] {
+                        {
+                            std::lock_guard<std::mutex> lock(state->mutex);
+                            if (state->closed)
+                                return;
+                            state->running++;
+                        }
+
+                        drain(*state);
+
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        if (--state->running == 0)
+                            state->done.notify_one();
+                    });
+                }
+
+                drain(*state);
+
+                // every chunk is taken, wait for the ones still running
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->closed = true;
+                state->done.wait(lock, [&] { return state->running == 0; });
+            }
+
+        private:
+            void work() {
+                for (;;) {
+                    std::function<void(void)> job;
+                    {
+                        std::unique_lock<std::mutex> lock(this->mutex);
+                        this->cv.wait(lock, [this] {
+                            return this->stopping || !this->queue.empty();
+                        });
+
+                        if (this->queue.empty())
+                            return;
+
+                        job = std::move(this->queue.front());
+                        this->queue.pop_front();
+                    }
+                    job();
+                }
+            }
+
+            std::vector<std::thread> threads;
+            std::deque<std::function<void(void)>> queue;
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool stopping = false;
+        };
+    };
+};
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <type_traits>
 
 #include "types.hpp"
@@ -44,5 +45,18 @@ namespace utils {
             else
                 return 1 + index<Target, Rest...>();
         }
+
+        inline u64 next_type_id() {
+            static std::atomic<u64> next {0};
+            return next++;
+        }
+
+        // A small integer unique to T in the program, handed out in the
+        // order the types are first asked for.
+        template<typename T>
+        u64 type_id() {
+            static const u64 id = next_type_id();
+            return id;
+        }
     };
 };
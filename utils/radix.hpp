@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+
+#include "types.hpp"
+
+namespace utils {
+    namespace radix {
+        // Map @v to an u64 that sorts (as an unsigned integer) in the same
+        // order as @v.
+        template<typename T>
+        u64 ordered(T v) {
+            static_assert(std::is_arithmetic<T>::value, "radix keys must be arithmetic");
+
+            if constexpr (std::is_floating_point<T>::value) {
+                // negative floats have all their bits flipped, positive
+                // ones only the sign bit
+                double d = v;
+                u64 bits;
+                std::memcpy(&bits, &d, sizeof(bits));
+                return bits & (u64(1) << 63) ? ~bits : bits | (u64(1) << 63);
+            } else if constexpr (std::is_signed<T>::value) {
+                return u64(i64(v)) ^ (u64(1) << 63);
+            } else {
+                return u64(v);
+            }
+        }
+
+        /**
+         * LSD radix sort of @v on the u64 returned by key(element), one byte
+         * per pass. Passes where every element has the same byte are
+         * skipped, so narrow keys only cost as many passes as they need.
+         */
+        template<typename T, typename Key>
+        void sort(std::vector<T>& v, Key key) {
+            if (v.size() < 2)
+                return;
+
+            std::array<std::array<size_t, 256>, 8> counts {};
+
+            for (const T& x : v) {
+                u64 k = key(x);
+                for (size_t pass = 0; pass < 8; pass++)
+                    counts[pass][(k >> (pass * 8)) & 0xff]++;
+            }
+
+            std::vector<T> scratch(v.size());
+
+            for (size_t pass = 0; pass < 8; pass++) {
+                auto& count = counts[pass];
+                u64 first = (key(v[0]) >> (pass * 8)) & 0xff;
+                if (count[first] == v.size())
+                    continue;
+
+                size_t offset = 0;
+                for (auto& c : count) {
+                    size_t n = c;
+                    c = offset;
+                    offset += n;
+                }
+
+                for (const T& x : v)
+                    scratch[count[(key(x) >> (pass * 8)) & 0xff]++] = x;
+
+                v.swap(scratch);
+            }
+        }
+    };
+};
@@ -10,6 +10,7 @@
 
 #pragma once
 
+#include <new>
 #include <iostream>
 #include <functional>
 #include <type_traits>
@@ -17,35 +18,49 @@
 namespace types {
     template<typename T>
     struct Ok {
-        Ok(const T& val) : val(val) { }
-        Ok(T&& val) : val(std::move(val)) { }
+        constexpr Ok(const T& val) : val(val) { }
+        constexpr Ok(T&& val) : val(std::move(val)) { }
 
         T val;
     };
 
+    template<typename T>
+    struct Ok<T&> {
+        constexpr Ok(T& val) : val(val) { }
+
+        T& val;
+    };
+
     template<>
     struct Ok<void> { };
 
     template<typename E>
     struct Err {
-        Err(const E& val) : val(val) { }
-        Err(E&& val) : val(std::move(val)) { }
+        constexpr Err(const E& val) : val(val) { }
+        constexpr Err(E&& val) : val(std::move(val)) { }
 
         E val;
     };
+
+    template<typename E>
+    struct Err<E&> {
+        constexpr Err(E& val) : val(val) { }
+
+        E& val;
+    };
 }
 
 template<typename T, typename CleanT = typename std::decay<T>::type>
-types::Ok<CleanT> Ok(T&& val) {
+constexpr types::Ok<CleanT> Ok(T&& val) {
     return types::Ok<CleanT>(std::forward<T>(val));
 }
 
-inline types::Ok<void> Ok() {
+constexpr types::Ok<void> Ok() {
     return types::Ok<void>();
 }
 
 template<typename E, typename CleanE = typename std::decay<E>::type>
-types::Err<CleanE> Err(E&& val) {
+constexpr types::Err<CleanE> Err(E&& val) {
     return types::Err<CleanE>(std::forward<E>(val));
 }
 
@@ -61,6 +76,9 @@ namespace impl {
     template<typename Ret, typename Cls, typename... Args>
     struct result_of<Ret (Cls::*)(Args...)> : public result_of<Ret (Args...)> { };
 
+    template<typename Ret, typename Cls, typename... Args>
+    struct result_of<Ret (Cls::*)(Args...) const> : public result_of<Ret (Args...)> { };
+
     template<typename Ret, typename... Args>
     struct result_of<Ret (Args...)> {
         typedef Ret type;
@@ -128,11 +146,11 @@ struct Map<Ret (Arg)> {
                 "Incompatible types detected");
 
         if (result.isOk()) {
-            auto res = func(result.storage().template get<T>());
+            auto res = func(result.storage().value());
             return types::Ok<Ret>(std::move(res));
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 };
 
@@ -144,11 +162,11 @@ struct Map<void (Arg)> {
     static Result<void, E> map(const Result<T, E>& result, Func func) {
 
         if (result.isOk()) {
-            func(result.storage().template get<T>());
+            func(result.storage().value());
             return types::Ok<void>();
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 };
 
@@ -166,7 +184,7 @@ struct Map<Ret (void)> {
             return types::Ok<Ret>(std::move(ret));
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 };
 
@@ -184,7 +202,7 @@ struct Map<void (void)> {
             return types::Ok<void>();
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 };
 
@@ -200,11 +218,11 @@ struct Map<Result<U, E> (Arg)> {
                 "Incompatible types detected");
 
         if (result.isOk()) {
-            auto res = func(result.storage().template get<T>());
+            auto res = func(result.storage().value());
             return res;
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 };
 
@@ -221,7 +239,7 @@ struct Map<Result<U, E> (void)> {
             return res;
         }
 
-        return types::Err<E>(result.storage().template get<E>());
+        return types::Err<E>(result.storage().error());
     }
 
 };
@@ -260,17 +278,17 @@ struct Map<Ret (Cls::*)(Arg) const> {
     template<typename T, typename E, typename Func>
     static Result<T, Ret> map(const Result<T, E>& result, Func func) {
         if (result.isErr()) {
-            auto res = func(result.storage().template get<E>());
+            auto res = func(result.storage().error());
             return types::Err<Ret>(res);
         }
 
-        return types::Ok<T>(result.storage().template get<T>());
+        return types::Ok<T>(result.storage().value());
     }
 
     template<typename E, typename Func>
     static Result<void, Ret> map(const Result<void, E>& result, Func func) {
         if (result.isErr()) {
-            auto res = func(result.storage().template get<E>());
+            auto res = func(result.storage().error());
             return types::Err<Ret>(res);
         }
 
@@ -309,7 +327,7 @@ namespace impl {
         template<typename T, typename E, typename Func>
         static Result<T, E> then(const Result<T, E>& result, Func func) {
             if (result.isOk()) {
-                func(result.storage().template get<T>());
+                func(result.storage().value());
             }
             return result;
         }
@@ -375,17 +393,17 @@ namespace impl {
                     "Incompatible types detected");
 
             if (result.isErr()) {
-                auto res = func(result.storage().template get<E>());
+                auto res = func(result.storage().error());
                 return res;
             }
 
-            return types::Ok<T>(result.storage().template get<T>());
+            return types::Ok<T>(result.storage().value());
         }
 
         template<typename E, typename Func>
         static Result<void, F> orElse(const Result<void, E>& result, Func func) {
             if (result.isErr()) {
-                auto res = func(result.storage().template get<E>());
+                auto res = func(result.storage().error());
                 return res;
             }
 
@@ -407,7 +425,7 @@ namespace impl {
                 return res;
             }
 
-            return types::Ok<T>(result.storage().template get<T>());
+            return types::Ok<T>(result.storage().value());
         }
 
         template<typename E, typename Func>
@@ -467,7 +485,7 @@ namespace impl {
                     "callback should not return anything, use mapError() for that");
 
             if (result.isErr()) {
-                func(result.storage().template get<E>());
+                func(result.storage().error());
             }
             return result;
         }
@@ -539,151 +557,222 @@ Ret orElse(const Result<T, E>& result, Func func) {
 struct ok_tag { };
 struct err_tag { };
 
-template<typename T, typename E>
-struct Storage {
-    static constexpr size_t Size = sizeof(T) > sizeof(E) ? sizeof(T) : sizeof(E);
-    static constexpr size_t Align = sizeof(T) > sizeof(E) ? alignof(T) : alignof(E);
+// Payload of a void Result
+struct Unit { };
 
-    typedef typename std::aligned_storage<Size, Align>::type type;
+/*
+ * How a payload of type T is kept inside a Result and handed back. Values are
+ * stored as is, references as pointers (so a Result<T&, E> is as cheap to copy
+ * as a pointer) and void as an empty Unit.
+ */
+template<typename T>
+struct Ref {
+    typedef T stored;
+    typedef T& type;
+    typedef const T& const_type;
+    typedef T moved_type;
 
-    Storage()
-        : initialized_(false)
-    { }
+    template<typename W>
+    static constexpr T&& store(W& wrapper) { return std::move(wrapper.val); }
 
-    void construct(types::Ok<T> ok)
-    {
-        new (&storage_) T(ok.val);
-        initialized_ = true;
-    }
-    void construct(types::Err<E> err)
-    {
-        new (&storage_) E(err.val);
-        initialized_ = true;
-    }
+    static constexpr T& get(T& v) { return v; }
+    static constexpr const T& get(const T& v) { return v; }
+};
 
-    template<typename U>
-    void rawConstruct(U&& val) {
-        typedef typename std::decay<U>::type CleanU;
+template<typename T>
+struct Ref<T&> {
+    typedef T* stored;
+    typedef T& type;
+    typedef T& const_type;
+    typedef T& moved_type;
 
-        new (&storage_) CleanU(std::forward<U>(val));
-        initialized_ = true;
-    }
+    template<typename W>
+    static constexpr T* store(W& wrapper) { return &wrapper.val; }
 
-    template<typename U>
-    const U& get() const {
-        return *reinterpret_cast<const U *>(&storage_);
-    }
+    static constexpr T& get(T* v) { return *v; }
+};
 
-    template<typename U>
-    U& get() {
-        return *reinterpret_cast<U *>(&storage_);
-    }
+template<>
+struct Ref<void> {
+    typedef Unit stored;
+    typedef void type;
+    typedef void const_type;
+    typedef void moved_type;
 
-    void destroy(ok_tag) {
-        if (initialized_) {
-            get<T>().~T();
-            initialized_ = false;
-        }
-    }
+    template<typename W>
+    static constexpr Unit store(W&) { return Unit(); }
 
-    void destroy(err_tag) {
-        if (initialized_) {
-            get<E>().~E();
-            initialized_ = false;
-        }
-    }
+    static constexpr void get(const Unit&) { }
+};
 
-    type storage_;
-    bool initialized_;
+// The union only gets a (non trivial) destructor when one of its members
+// needs it, so that it stays trivial otherwise.
+template<typename S, typename F, bool Trivial>
+union Payload {
+    constexpr Payload() : none() { }
+
+    template<typename... Args>
+    constexpr Payload(ok_tag, Args&&... args) : value(std::forward<Args>(args)...) { }
+
+    template<typename... Args>
+    constexpr Payload(err_tag, Args&&... args) : error(std::forward<Args>(args)...) { }
+
+    Unit none;
+    S value;
+    F error;
 };
 
-template<typename E>
-struct Storage<void, E> {
-    typedef typename std::aligned_storage<sizeof(E), alignof(E)>::type type;
+template<typename S, typename F>
+union Payload<S, F, false> {
+    constexpr Payload() : none() { }
 
-    void construct(types::Ok<void>)
-    {
-        initialized_ = true;
-    }
+    template<typename... Args>
+    constexpr Payload(ok_tag, Args&&... args) : value(std::forward<Args>(args)...) { }
 
-    void construct(types::Err<E> err)
-    {
-        new (&storage_) E(err.val);
-        initialized_ = true;
-    }
+    template<typename... Args>
+    constexpr Payload(err_tag, Args&&... args) : error(std::forward<Args>(args)...) { }
 
-    template<typename U>
-    void rawConstruct(U&& val) {
-        typedef typename std::decay<U>::type CleanU;
+    ~Payload() { }
 
-        new (&storage_) CleanU(std::forward<U>(val));
-        initialized_ = true;
-    }
+    Unit none;
+    S value;
+    F error;
+};
 
-    void destroy(ok_tag) { initialized_ = false; }
-    void destroy(err_tag) {
-        if (initialized_) {
-            get<E>().~E(); initialized_ = false;
-        }
+template<typename T, typename E>
+struct StorageData {
+    typedef typename Ref<T>::stored value_stored;
+    typedef typename Ref<E>::stored error_stored;
+
+    static constexpr bool Trivial =
+        std::is_trivially_copyable<value_stored>::value &&
+        std::is_trivially_copyable<error_stored>::value;
+
+    constexpr StorageData()
+        : payload_(), ok_(false)
+    { }
+
+    constexpr StorageData(types::Ok<T> ok)
+        : payload_(ok_tag(), Ref<T>::store(ok)), ok_(true)
+    { }
+
+    constexpr StorageData(types::Err<E> err)
+        : payload_(err_tag(), Ref<E>::store(err)), ok_(false)
+    { }
+
+    constexpr bool isOk() const {
+        return ok_;
     }
 
+    constexpr typename Ref<T>::type value() { return Ref<T>::get(payload_.value); }
+    constexpr typename Ref<T>::const_type value() const { return Ref<T>::get(payload_.value); }
+
+    constexpr typename Ref<E>::type error() { return Ref<E>::get(payload_.error); }
+    constexpr typename Ref<E>::const_type error() const { return Ref<E>::get(payload_.error); }
+
+    // Access by type, when T and E are the same type the active one is used.
     template<typename U>
-    const U& get() const {
-        return *reinterpret_cast<const U *>(&storage_);
+    constexpr decltype(auto) get() {
+        if constexpr (std::is_same<U, T>::value && !std::is_same<U, E>::value)
+            return value();
+        else if constexpr (std::is_same<U, E>::value && !std::is_same<U, T>::value)
+            return error();
+        else
+            return ok_ ? value() : error();
     }
 
     template<typename U>
-    U& get() {
-        return *reinterpret_cast<U *>(&storage_);
+    constexpr decltype(auto) get() const {
+        if constexpr (std::is_same<U, T>::value && !std::is_same<U, E>::value)
+            return value();
+        else if constexpr (std::is_same<U, E>::value && !std::is_same<U, T>::value)
+            return error();
+        else
+            return ok_ ? value() : error();
     }
 
-    type storage_;
-    bool initialized_;
-};
-
-template<typename T, typename E>
-struct Constructor {
-
-    static void move(Storage<T, E>&& src, Storage<T, E>& dst, ok_tag) {
-        dst.rawConstruct(std::move(src.template get<T>()));
-        src.destroy(ok_tag());
+protected:
+    void copy(const StorageData& other) {
+        if (other.ok_)
+            new (&payload_.value) value_stored(other.payload_.value);
+        else
+            new (&payload_.error) error_stored(other.payload_.error);
+        ok_ = other.ok_;
     }
 
-    static void copy(const Storage<T, E>& src, Storage<T, E>& dst, ok_tag) {
-        dst.rawConstruct(src.template get<T>());
+    void move(StorageData&& other) {
+        if (other.ok_)
+            new (&payload_.value) value_stored(std::move(other.payload_.value));
+        else
+            new (&payload_.error) error_stored(std::move(other.payload_.error));
+        ok_ = other.ok_;
     }
 
-    static void move(Storage<T, E>&& src, Storage<T, E>& dst, err_tag) {
-        dst.rawConstruct(std::move(src.template get<E>()));
-        src.destroy(err_tag());
+    void destroy() {
+        if (ok_)
+            payload_.value.~value_stored();
+        else
+            payload_.error.~error_stored();
     }
 
-    static void copy(const Storage<T, E>& src, Storage<T, E>& dst, err_tag) {
-        dst.rawConstruct(src.template get<E>());
-    }
+    Payload<value_stored, error_stored, Trivial> payload_;
+    bool ok_;
 };
 
-template<typename E>
-struct Constructor<void, E> {
-    static void move(Storage<void, E>&& src, Storage<void, E>& dst, ok_tag) {
+/*
+ * Storage of payloads that aren't both trivially copyable: the copy, move and
+ * destruction of the active payload are dispatched on the tag.
+ */
+template<typename T, typename E>
+struct OwningStorage : public StorageData<T, E> {
+    using StorageData<T, E>::StorageData;
+
+    OwningStorage(const OwningStorage& other)
+        : StorageData<T, E>()
+    {
+        this->copy(other);
     }
 
-    static void copy(const Storage<void, E>& src, Storage<void, E>& dst, ok_tag) {
+    OwningStorage(OwningStorage&& other)
+        : StorageData<T, E>()
+    {
+        this->move(std::move(other));
+    }
+
+    OwningStorage& operator=(const OwningStorage& other) {
+        if (this != &other) {
+            this->destroy();
+            this->copy(other);
+        }
+        return *this;
     }
 
-    static void move(Storage<void, E>&& src, Storage<void, E>& dst, err_tag) {
-        dst.rawConstruct(std::move(src.template get<E>()));
-        src.destroy(err_tag());
+    OwningStorage& operator=(OwningStorage&& other) {
+        if (this != &other) {
+            this->destroy();
+            this->move(std::move(other));
+        }
+        return *this;
     }
 
-    static void copy(const Storage<void, E>& src, Storage<void, E>& dst, err_tag) {
-        dst.rawConstruct(src.template get<E>());
+    ~OwningStorage() {
+        this->destroy();
     }
 };
 
+/*
+ * When both payloads are trivially copyable the storage (and the Result around
+ * it) is too: copies are plain {payload, tag} copies and nothing runs on
+ * destruction. StorageData is then used as is, a derived class would keep GCC
+ * from building the pair in registers.
+ */
+template<typename T, typename E>
+using Storage = typename std::conditional<StorageData<T, E>::Trivial,
+        StorageData<T, E>, OwningStorage<T, E>>::type;
+
 } // namespace details
 
-namespace concept {
+namespace concepts {
 
 template<typename T, typename = void> struct EqualityComparable : std::false_type { };
 
@@ -698,68 +787,48 @@ typename std::enable_if<
 };
 
 
-} // namespace concept
+} // namespace concepts
 
 template<typename T, typename E>
-struct Result {
+struct [[nodiscard]] Result {
 
     static_assert(!std::is_same<E, void>::value, "void error type is not allowed");
 
     typedef details::Storage<T, E> storage_type;
 
-    Result(types::Ok<T> ok)
-        : ok_(true)
-    {
-        storage_.construct(std::move(ok));
-    }
+    typedef typename details::Ref<T>::type ref_type;
+    typedef typename details::Ref<T>::const_type const_ref_type;
+    typedef typename details::Ref<T>::moved_type moved_type;
 
-    Result(types::Err<E> err)
-        : ok_(false)
-    {
-        storage_.construct(std::move(err));
-    }
+    constexpr Result(types::Ok<T> ok)
+        : storage_(std::move(ok))
+    { }
 
-    Result(Result&& other) {
-        if (other.isOk()) {
-            details::Constructor<T, E>::move(std::move(other.storage_), storage_, details::ok_tag());
-            ok_ = true;
-        } else {
-            details::Constructor<T, E>::move(std::move(other.storage_), storage_, details::err_tag());
-            ok_ = false;
-        }
-    }
+    constexpr Result(types::Err<E> err)
+        : storage_(std::move(err))
+    { }
 
-    Result(const Result& other) {
-        if (other.isOk()) {
-            details::Constructor<T, E>::copy(other.storage_, storage_, details::ok_tag());
-            ok_ = true;
-        } else {
-            details::Constructor<T, E>::copy(other.storage_, storage_, details::err_tag());
-            ok_ = false;
-        }
+    constexpr bool isOk() const {
+        return storage_.isOk();
     }
 
-    ~Result() {
-        if (ok_)
-            storage_.destroy(details::ok_tag());
-        else
-            storage_.destroy(details::err_tag());
+    constexpr bool isErr() const {
+        return !storage_.isOk();
     }
 
-    bool isOk() const {
-        return ok_;
+    constexpr ref_type expect(const char* str) & {
+        check(str);
+        return storage_.value();
     }
 
-    bool isErr() const {
-        return !ok_;
+    constexpr const_ref_type expect(const char* str) const & {
+        check(str);
+        return storage_.value();
     }
 
-    T expect(const char* str) const {
-        if (!isOk()) {
-            std::fprintf(stderr, "%s\n", str);
-            std::terminate(); 
-        }
-        return expect_impl(std::is_same<T, void>());
+    constexpr moved_type expect(const char* str) && {
+        check(str);
+        return moved();
     }
 
     template<typename Func,
@@ -808,77 +877,129 @@ struct Result {
         return details::orElse(*this, func);
     }
 
-    storage_type& storage() {
+    constexpr storage_type& storage() {
         return storage_;
     }
 
-    const storage_type& storage() const {
+    constexpr const storage_type& storage() const {
         return storage_;
     }
 
+    // A Result borrowing the payload of this one.
+    constexpr Result<
+        typename details::Ref<T>::const_type,
+        typename details::Ref<E>::const_type
+    > as_ref() const {
+        if (isOk()) {
+            if constexpr (std::is_same<T, void>::value)
+                return types::Ok<void>();
+            else
+                return types::Ok<const_ref_type>(storage_.value());
+        }
+        return types::Err<typename details::Ref<E>::const_type>(storage_.error());
+    }
+
     template<typename U = T>
-    typename std::enable_if<
+    constexpr typename std::enable_if<
         !std::is_same<U, void>::value,
         U
     >::type
     unwrapOr(const U& defaultValue) const {
         if (isOk()) {
-            return storage().template get<U>();
+            return storage().value();
         }
         return defaultValue;
     }
 
     template<typename U = T>
-    typename std::enable_if<
+    constexpr typename std::enable_if<
         !std::is_same<U, void>::value,
-        U
+        ref_type
     >::type
-    unwrap() const {
-        if (isOk()) {
-            return storage().template get<U>();
-        }
+    unwrap() & {
+        check("Attempting to unwrap an error Result");
+        return storage_.value();
+    }
+
+    template<typename U = T>
+    constexpr typename std::enable_if<
+        !std::is_same<U, void>::value,
+        const_ref_type
+    >::type
+    unwrap() const & {
+        check("Attempting to unwrap an error Result");
+        return storage_.value();
+    }
 
-        std::fprintf(stderr, "Attempting to unwrap an error Result\n");
-        std::terminate();
+    // Move the payload out of a temporary Result.
+    template<typename U = T>
+    constexpr typename std::enable_if<
+        !std::is_same<U, void>::value,
+        moved_type
+    >::type
+    unwrap() && {
+        check("Attempting to unwrap an error Result");
+        return moved();
     }
 
-    E unwrapErr() const {
-        if (isErr()) {
-            return storage().template get<E>();
+    constexpr typename details::Ref<E>::const_type unwrapErr() const & {
+        if (isOk()) {
+            std::fprintf(stderr, "Attempting to unwrapErr an ok Result\n");
+            std::terminate();
         }
+        return storage_.error();
+    }
 
-        std::fprintf(stderr, "Attempting to unwrapErr an ok Result\n");
-        std::terminate();
+    constexpr typename details::Ref<E>::moved_type unwrapErr() && {
+        if (isOk()) {
+            std::fprintf(stderr, "Attempting to unwrapErr an ok Result\n");
+            std::terminate();
+        }
+        if constexpr (std::is_reference<E>::value)
+            return storage_.error();
+        else
+            return std::move(storage_.error());
     }
 
 private:
-    T expect_impl(std::true_type) const { }
-    T expect_impl(std::false_type) const { return storage_.template get<T>(); }
+    constexpr void check(const char* str) const {
+        if (!isOk()) {
+            std::fprintf(stderr, "%s\n", str);
+            std::terminate();
+        }
+    }
+
+    constexpr moved_type moved() {
+        if constexpr (std::is_reference<T>::value)
+            return storage_.value();
+        else if constexpr (!std::is_same<T, void>::value)
+            return std::move(storage_.value());
+    }
 
-    bool ok_;
     storage_type storage_;
 };
 
 template<typename T, typename E>
 bool operator==(const Result<T, E>& lhs, const Result<T, E>& rhs) {
-    static_assert(concept::EqualityComparable<T>::value, "T must be EqualityComparable for Result to be comparable");
-    static_assert(concept::EqualityComparable<E>::value, "E must be EqualityComparable for Result to be comparable");
+    static_assert(concepts::EqualityComparable<T>::value, "T must be EqualityComparable for Result to be comparable");
+    static_assert(concepts::EqualityComparable<E>::value, "E must be EqualityComparable for Result to be comparable");
 
     if (lhs.isOk() && rhs.isOk()) {
-        return lhs.storage().template get<T>() == rhs.storage().template get<T>();
+        return lhs.storage().value() == rhs.storage().value();
     }
     if (lhs.isErr() && rhs.isErr()) {
-        return lhs.storage().template get<E>() == rhs.storage().template get<E>();
+        return lhs.storage().error() == rhs.storage().error();
     }
+    return false;
 }
 
 template<typename T, typename E>
 bool operator==(const Result<T, E>& lhs, types::Ok<T> ok) {
-    static_assert(concept::EqualityComparable<T>::value, "T must be EqualityComparable for Result to be comparable");
+    static_assert(concepts::EqualityComparable<T>::value, "T must be EqualityComparable for Result to be comparable");
 
     if (!lhs.isOk()) return false;
 
-    return lhs.storage().template get<T>() == ok.val;
+    return lhs.storage().value() == ok.val;
 }
 
 template<typename E>
@@ -888,10 +1009,10 @@ bool operator==(const Result<void, E>& lhs, types::Ok<void>) {
 
 template<typename T, typename E>
 bool operator==(const Result<T, E>& lhs, types::Err<E> err) {
-    static_assert(concept::EqualityComparable<E>::value, "E must be EqualityComparable for Result to be comparable");
+    static_assert(concepts::EqualityComparable<E>::value, "E must be EqualityComparable for Result to be comparable");
     if (!lhs.isErr()) return false;
 
-    return lhs.storage().template get<E>() == err.val;
+    return lhs.storage().error() == err.val;
 }
 
 #define TRY(...)                                                   \
@@ -899,8 +1020,27 @@ bool operator==(const Result<T, E>& lhs, types::Err<E> err) {
         auto res = __VA_ARGS__;                                    \
         if (!res.isOk()) {                                         \
             typedef details::ResultErrType<decltype(res)>::type E; \
-            return types::Err<E>(res.storage().get<E>());          \
+            return types::Err<E>(res.storage().error());           \
         }                                                          \
-        typedef details::ResultOkType<decltype(res)>::type T;      \
-        res.storage().get<T>();                                    \
+        res.storage().value();                                     \
     })
+
+namespace details {
+
+// A Result of trivially copyable payloads is a plain {payload, tag} pair: it is
+// trivially copyable, usable in constant expressions and returned in registers
+// (timed against a plain struct by bench/result.cc).
+static_assert(std::is_trivially_copyable<Result<int, int>>::value,
+        "Result<int, int> must be trivially copyable");
+static_assert(std::is_trivially_copyable<Result<int&, int>>::value,
+        "Result<int&, int> must be trivially copyable");
+static_assert(std::is_trivially_copyable<Result<void, int>>::value,
+        "Result<void, int> must be trivially copyable");
+static_assert(sizeof(Result<int, int>) == 2 * sizeof(int),
+        "Result<int, int> must be an int and a tag");
+static_assert(Result<int, int>(types::Ok<int>(42)).unwrap() == 42,
+        "Result must be usable in constant expressions");
+static_assert(Result<int, int>(types::Err<int>(7)).unwrapErr() == 7,
+        "Result must be usable in constant expressions");
+
+} // namespace details
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+#include "types.hpp"
+
+namespace utils {
+    namespace segmented {
+        // target size of a block, a page
+        static constexpr size_t BLOCK_BYTES = 4096;
+
+        // blocks start on a cache line
+        static constexpr size_t BLOCK_ALIGN = 64;
+
+        // log2 of the number of elements of @size bytes in a block: as
+        // many as fit in BLOCK_BYTES, rounded down to a power of two, and
+        // at least one.
+        constexpr size_t block_shift(size_t size) {
+            size_t shift = 0;
+            while ((size << (shift + 1)) <= BLOCK_BYTES)
+                shift++;
+            return shift;
+        }
+
+        /**
+         * A vector split in blocks of about a page. Growing it only ever
+         * allocates new blocks, so elements never move and references to
+         * them stay valid until they are erased. Blocks hold a power of
+         * two elements, finding one is a shift and a mask, and the
+         * elements of a block are contiguous.
+         */
+        template<typename T>
+        class Vector {
+        public:
+            static constexpr size_t SHIFT = block_shift(sizeof(T));
+            static constexpr size_t BLOCK = size_t(1) << SHIFT;
+            static constexpr size_t ALIGN = std::max(BLOCK_ALIGN, alignof(T));
+
+            Vector() = default;
+
+            Vector(Vector&& other)
+                : blocks(std::move(other.blocks))
+                , count(std::exchange(other.count, 0)) { }
+
+            Vector(const Vector&) = delete;
+            Vector& operator=(const Vector&) = delete;
+
+            ~Vector() {
+                this->resize(0);
+                this->shrink_to_fit();
+            }
+
+            size_t size() const {
+                return this->count;
+            }
+
+            bool empty() const {
+                return this->count == 0;
+            }
+
+            size_t capacity() const {
+                return this->blocks.size() * BLOCK;
+            }
+
+            T& operator[](size_t i) {
+                return this->blocks[i >> SHIFT][i & (BLOCK - 1)];
+            }
+
+            const T& operator[](size_t i) const {
+                return this->blocks[i >> SHIFT][i & (BLOCK - 1)];
+            }
+
+            // number of elements from @i to the end of its block, all of
+            // them contiguous in memory
+            static size_t contiguous(size_t i) {
+                return BLOCK - (i & (BLOCK - 1));
+            }
+
+            template<typename ...Args>
+            T& emplace_back(Args&&... args) {
+                this->reserve(this->count + 1);
+                T* p = new (&(*this)[this->count]) T(std::forward<Args>(args)...);
+                this->count++;
+                return *p;
+            }
+
+            void push_back(const T& value) {
+                this->emplace_back(value);
+            }
+
+            // Grow to @n default constructed elements, or destroy the ones
+            // past @n. Blocks are kept, see shrink_to_fit().
+            void resize(size_t n) {
+                this->reserve(n);
+                for (; this->count < n; this->count++)
+                    new (&(*this)[this->count]) T();
+                this->destroy_from(n);
+            }
+
+            // resize() with copies of @value for the new elements
+            void resize(size_t n, const T& value) {
+                this->reserve(n);
+                for (; this->count < n; this->count++)
+                    new (&(*this)[this->count]) T(value);
+                this->destroy_from(n);
+            }
+
+            // Make room for @n elements, allocating only the missing blocks.
+            void reserve(size_t n) {
+                while (this->capacity() < n)
+                    this->blocks.push_back(static_cast<T*>(
+                        ::operator new(BLOCK * sizeof(T), std::align_val_t(ALIGN))));
+            }
+
+            // Release the blocks past the last element.
+            void shrink_to_fit() {
+                size_t used = (this->count + BLOCK - 1) >> SHIFT;
+                for (size_t b = used; b < this->blocks.size(); b++)
+                    ::operator delete(this->blocks[b], std::align_val_t(ALIGN));
+                this->blocks.resize(used);
+                this->blocks.shrink_to_fit();
+            }
+
+        private:
+            void destroy_from(size_t n) {
+                for (; this->count > n; this->count--)
+                    (*this)[this->count - 1].~T();
+            }
+
+            std::vector<T*> blocks;
+            size_t count = 0;
+        };
+    };
+};
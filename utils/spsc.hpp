@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+#include "types.hpp"
+
+namespace utils {
+    namespace spsc {
+        /**
+         * Bounded lock-free queue for exactly one producer thread and one
+         * consumer thread. head is only written by the consumer and tail
+         * only by the producer, each on its own cache line; both keep a
+         * cached copy of the other index so the shared one is only read
+         * when the queue looks full (or empty).
+         */
+        template<typename T>
+        class Queue {
+        public:
+            // @capacity is rounded up to a power of two
+            explicit Queue(size_t capacity) {
+                size_t n = 2;
+                while (n < capacity)
+                    n *= 2;
+
+                this->items.resize(n);
+                this->mask = n - 1;
+            }
+
+            Queue(const Queue&) = delete;
+            Queue& operator=(const Queue&) = delete;
+
+            size_t capacity() const {
+                return this->items.size();
+            }
+
+            // Producer side: whether the next push() would fail.
+            bool full() {
+                size_t tail = this->tail.load(std::memory_order_relaxed);
+                if (tail - this->head_cache == this->items.size())
+                    this->head_cache = this->head.load(std::memory_order_acquire);
+                return tail - this->head_cache == this->items.size();
+            }
+
+            // Producer side. Returns false, leaving @item untouched, if the
+            // queue is full.
+            bool push(T&& item) {
+                size_t tail = this->tail.load(std::memory_order_relaxed);
+
+                if (tail - this->head_cache == this->items.size()) {
+                    this->head_cache = this->head.load(std::memory_order_acquire);
+                    if (tail - this->head_cache == this->items.size())
+                        return false;
+                }
+
+                this->items[tail & this->mask] = std::move(item);
+                this->tail.store(tail + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Consumer side. Returns false if the queue is empty.
+            bool pop(T& item) {
+                size_t head = this->head.load(std::memory_order_relaxed);
+
+                if (head == this->tail_cache) {
+                    this->tail_cache = this->tail.load(std::memory_order_acquire);
+                    if (head == this->tail_cache)
+                        return false;
+                }
+
+                item = std::move(this->items[head & this->mask]);
+                this->head.store(head + 1, std::memory_order_release);
+                return true;
+            }
+
+            /**
+             * Consumer side: call fn(item) on everything queued so far and
+             * release all of it at once, with a single store of head.
+             * Returns the number of items consumed.
+             */
+            template<typename F>
+            size_t drain(F&& fn) {
+                size_t head = this->head.load(std::memory_order_relaxed);
+                size_t tail = this->tail.load(std::memory_order_acquire);
+                this->tail_cache = tail;
+
+                for (size_t i = head; i != tail; i++)
+                    fn(std::move(this->items[i & this->mask]));
+
+                this->head.store(tail, std::memory_order_release);
+                return tail - head;
+            }
+
+        private:
+            static constexpr size_t LINE = 64;
+
+            std::vector<T> items;
+            size_t mask;
+
+            alignas(LINE) std::atomic<size_t> head {0};
+            size_t tail_cache = 0;
+
+            alignas(LINE) std::atomic<size_t> tail {0};
+            size_t head_cache = 0;
+        };
+    };
+};